@@ -0,0 +1,76 @@
+// Checks the error bounds documented in src/approx.hpp against libm, in
+// double precision, over the ranges Kanon and Terminal use them in.
+// Build and run with `make check`; exits with 1 if any bound is exceeded.
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include "../src/approx.hpp"
+
+using rack::simd::float_4;
+
+// points per unit of input
+static const int DENSITY = 1 << 16;
+
+static int failures = 0;
+
+static void report(const char* name, double error, double bound, const char* unit)
+{
+    bool ok = error <= bound;
+    std::printf("%-44s %12.4g %-6s (bound %g)%s\n", name, error, unit, bound, ok ? "" : "  FAIL");
+    if (!ok) failures++;
+}
+
+// how far the float_4 flavour is from the scalar one, which it should match exactly
+template <typename F, typename G>
+static double simdDifference(float x, F scalar, G vector)
+{
+    float v[4];
+    vector(float_4(x, x + 0.25f, x + 0.5f, x + 0.75f)).store(v);
+    double difference = 0.0;
+    for (int i = 0; i < 4; i++) difference = std::max(difference, (double) std::fabs(v[i] - scalar(x + i * 0.25f)));
+    return difference;
+}
+
+int main()
+{
+    // 1V/oct over the full +-10V input range plus the coarse/fine offsets
+    double exp2_rel = 0.0;
+    double exp2_simd = 0.0;
+    for (int i = -16 * DENSITY; i <= 16 * DENSITY; i++) {
+        float x = (float) i / DENSITY;
+        double exact = std::exp2((double) x);
+        exp2_rel = std::max(exp2_rel, std::fabs(approx::exp2(x) / exact - 1.0));
+        if (i % 64 == 0)
+            exp2_simd = std::max(exp2_simd, simdDifference(x, [](float x) { return approx::exp2(x); }, [](float_4 x) { return approx::exp2(x); }));
+    }
+    report("exp2 relative error over [-16, 16]", exp2_rel, 1.8e-7, "");
+    report("exp2 pitch error as volt2freq()", 1200.0 * std::log2(1.0 + exp2_rel), 0.0003, "cents");
+    report("exp2 float_4 against scalar", exp2_simd, 0.0, "");
+
+    double sin_abs = 0.0;
+    double sin_simd = 0.0;
+    for (int i = -3 * DENSITY; i <= 3 * DENSITY; i++) {
+        float phase = (float) i / DENSITY;
+        double exact = std::sin(2.0 * M_PI * (double) phase);
+        sin_abs = std::max(sin_abs, std::fabs(approx::sin2pi(phase) - exact));
+        if (i % 64 == 0)
+            sin_simd = std::max(sin_simd, simdDifference(phase, [](float x) { return approx::sin2pi(x); }, [](float_4 x) { return approx::sin2pi(x); }));
+    }
+    report("sin2pi absolute error over [-3, 3]", sin_abs, 7.4e-7, "");
+    report("sin2pi error relative to full scale", 20.0 * std::log10(sin_abs), -122.0, "dB");
+    report("sin2pi float_4 against scalar", sin_simd, 0.0, "");
+
+    // the soft clipper only sees +-3 after scaling, and is held beyond
+    double clip_abs = 0.0;
+    for (int i = -6 * DENSITY; i <= 6 * DENSITY; i++) {
+        float x = (float) i / DENSITY;
+        clip_abs = std::max(clip_abs, std::fabs(approx::softclip(float_4(x))[0] - std::tanh((double) x)));
+    }
+    report("softclip absolute error against tanh", clip_abs, 0.024, "");
+
+    if (failures) {
+        std::fprintf(stderr, "%d bound(s) exceeded\n", failures);
+        return 1;
+    }
+    return 0;
+}
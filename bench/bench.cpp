@@ -0,0 +1,266 @@
+// Standalone microbenchmark of the Rack-independent DSP cores.
+//
+// Reports ns/sample and samples/s for every Kanon oscillator, waveshape,
+// mode and canon depth, and for several Terminal interpolation, storage, voice count and
+// delay-time/CV configurations, at the usual engine sample rates.
+// Build and run with `make bench`.
+//
+//     bench                          print the results
+//     bench --baseline FILE          also compare against FILE, and exit with
+//                                    1 if any case got slower than allowed or
+//                                    is missing from it; without a baseline in
+//                                    FILE, only print the results
+//     bench --write-baseline FILE    save the results as the new baseline
+//     bench --tolerance X            allowed slowdown, default 0.1 (10%)
+//     bench --filter STR             only run cases whose name contains STR
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+#include "../src/kanon_core.hpp"
+#include "../src/terminal_core.hpp"
+
+
+static const float SAMPLE_RATES[] = { 44100.f, 48000.f, 96000.f, 192000.f };
+// seconds of audio rendered per run, and runs per case (the fastest one counts)
+static const float SECONDS = 1.f;
+static const int RUNS = 5;
+
+// keeps the compiler from optimizing the work away
+static volatile float sink;
+// only cases whose name contains this are run
+static const char* filter = "";
+
+struct Result {
+    std::string name;
+    double ns_per_sample;
+};
+
+template <typename F>
+static double timeRuns(int frames, F run)
+{
+    double best = 1e30;
+    for (int r = 0; r < RUNS; r++) {
+        auto start = std::chrono::steady_clock::now();
+        run();
+        auto end = std::chrono::steady_clock::now();
+        best = std::min(best, std::chrono::duration<double, std::nano>(end - start).count() / frames);
+    }
+    return best;
+}
+
+static void benchKanon(float sr, uint8_t oscillator, uint8_t waveshape, uint8_t mode, int voices, int channels, int unison, uint16_t patched, std::vector<Result>& results)
+{
+    static const char* OSCILLATORS[] = { "polyblep", "wavetable" };
+    static const char* WAVESHAPES[] = { "sine", "triangle", "square", "saw" };
+    static const char* MODES[] = { "kanon", "fwdfwd", "fwdbwd", "rnd" };
+
+    char name[128], stack[16] = "";
+    if (unison > 1) std::snprintf(stack, sizeof(stack), "x%d", unison);
+    std::snprintf(name, sizeof(name), "kanon/%s/%s/%s/%dv%s%s/%dch/%d", OSCILLATORS[oscillator], WAVESHAPES[waveshape], MODES[mode], voices, stack, patched == 0xffff ? "" : "+1out", channels, (int) sr);
+    if (!std::strstr(name, filter)) return;
+
+    KanonCore core;
+    core.setOscillator(oscillator);
+    core.setWaveshape(waveshape);
+    core.setMode(mode);
+    core.setVoices(voices);
+    core.setUnison(unison);
+    for (int c = 0; c < channels; c++) core.setSpread(c, 0.2f / 12.f);
+    // 0xffff as if the poly output were patched, so every voice is computed
+    core.setActive(patched);
+    core.channels = channels;
+
+    int frames = (int) (SECONDS * sr);
+    // new notes every 1/8 s, so the pitch assignment runs too
+    std::vector<float> notes(frames);
+    for (int f = 0; f < frames; f++)
+        notes[f] = ((f / (int) (sr / 8)) * 7 % 24) / 12.f - 1.f;
+
+    float vocts[16];
+    float out[16 * KanonCore::MAX_VOICES];
+
+    double ns = timeRuns(frames, [&]() {
+        float sum = 0.f;
+        for (int f = 0; f < frames; f++) {
+            for (int c = 0; c < channels; c++) vocts[c] = notes[f] + c / 12.f;
+            core.process(0.f, 1.f / sr, vocts, out);
+            sum += out[0];
+        }
+        sink = sum;
+    });
+
+    results.push_back({ name, ns });
+}
+
+enum DelayConfig {
+    STATIC_SHORT,
+    STATIC_LONG,
+    SLOW_CV,
+    FAST_CV,
+    DELAY_CONFIGS_LEN
+};
+
+static void benchTerminal(float sr, uint8_t interpolation, bool dual_head, uint8_t storage, int config, int voices, std::vector<Result>& results)
+{
+    static const char* INTERPOLATIONS[] = { "linear", "hermite", "allpass" };
+    static const char* CONFIGS[] = { "static-10ms", "static-2.9s", "cv-1hz", "cv-40hz" };
+
+    char name[128];
+    std::snprintf(name, sizeof(name), "terminal/%s%s%s/%s/%dv/%d", INTERPOLATIONS[interpolation], dual_head ? "+dual" : "", storage == STORAGE_COMPACT ? "+i16" : "", CONFIGS[config], voices, (int) sr);
+    if (!std::strstr(name, filter)) return;
+
+    TerminalCore core;
+    core.setInterpolation(interpolation);
+    core.setDualHead(dual_head);
+    core.setStorage(storage);
+    core.setSampleRate(sr);
+    for (int i = 0; i < TERMINAL_CHANNELS; i++) core.setVoices(i, voices);
+    // what the module's worker thread does, done up front
+    core.swapBuffers();
+    core.prepareBuffers();
+    core.swapBuffers();
+
+    int frames = (int) (SECONDS * sr);
+    std::vector<float> noise(frames), delays(frames);
+    uint32_t x = 1;
+    for (int f = 0; f < frames; f++) {
+        x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+        noise[f] = (x / 4294967296.f - 0.5f) * 10.f;
+        float t = f / sr;
+        switch (config) {
+            case STATIC_SHORT: delays[f] = 0.01f; break;
+            case STATIC_LONG:  delays[f] = 2.9f; break;
+            case SLOW_CV:      delays[f] = 1.5f + 0.5f * std::sin(2.f * M_PI * 1.f * t); break;
+            default:           delays[f] = 0.5f + 0.01f * std::sin(2.f * M_PI * 40.f * t); break;
+        }
+    }
+
+    // each channel's voices spread over a range of delay times
+    int lanes = core.layout.lanes;
+    float spread[TerminalCore::LANES] = {};
+    for (int lane = 0; lane < lanes; lane++) spread[lane] = 1.f / (1 + lane % voices) / (1 << lane / voices);
+
+    float gain[TerminalCore::LANES], delay_time[TerminalCore::LANES] = {};
+    float input[2][TerminalCore::LANES] = {}, arrival[2][TerminalCore::LANES] = {}, departure[2][TerminalCore::LANES];
+    std::fill(gain, gain + TerminalCore::LANES, 0.5f);
+
+    double ns = timeRuns(frames, [&]() {
+        float sum = 0.f;
+        for (int f = 0; f < frames; f++) {
+            for (int lane = 0; lane < lanes; lane++) {
+                input[0][lane] = noise[f];
+                input[1][lane] = -noise[f];
+                arrival[0][lane] = noise[frames - 1 - f];
+                arrival[1][lane] = noise[f];
+                delay_time[lane] = delays[f] * spread[lane];
+            }
+            core.process(input, arrival, gain, delay_time, departure);
+            sum += departure[0][0];
+        }
+        sink = sum;
+    });
+
+    results.push_back({ name, ns });
+}
+
+// False if there's no baseline to read, which would leave nothing to compare against.
+static bool readBaseline(const char* path, std::map<std::string, double>& baseline)
+{
+    FILE* f = std::fopen(path, "r");
+    if (!f) return false;
+    char name[256];
+    double ns;
+    while (std::fscanf(f, "%255s %lf", name, &ns) == 2) baseline[name] = ns;
+    std::fclose(f);
+    return !baseline.empty();
+}
+
+int main(int argc, char** argv)
+{
+    const char* baseline_path = nullptr;
+    const char* write_path = nullptr;
+    double tolerance = 0.1;
+
+    for (int a = 1; a < argc; a++) {
+        if (!std::strcmp(argv[a], "--baseline") && a + 1 < argc) baseline_path = argv[++a];
+        else if (!std::strcmp(argv[a], "--write-baseline") && a + 1 < argc) write_path = argv[++a];
+        else if (!std::strcmp(argv[a], "--tolerance") && a + 1 < argc) tolerance = std::atof(argv[++a]);
+        else if (!std::strcmp(argv[a], "--filter") && a + 1 < argc) filter = argv[++a];
+        else {
+            std::fprintf(stderr, "usage: %s [--baseline FILE] [--write-baseline FILE] [--tolerance X] [--filter STR]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    // timings only compare on the same machine, so a fresh checkout has none
+    std::map<std::string, double> baseline;
+    bool compare = baseline_path && readBaseline(baseline_path, baseline);
+
+    std::vector<Result> results;
+    for (float sr : SAMPLE_RATES) {
+        for (uint8_t o = KanonCore::POLYBLEP; o <= KanonCore::WAVETABLE; o++)
+            for (uint8_t w = KanonCore::SINE; w <= KanonCore::SAW; w++)
+                for (uint8_t m = KanonCore::KANON; m <= KanonCore::RND; m++)
+                    for (int voices : { 4, 16 })
+                        for (int channels : { 1, 16 })
+                            benchKanon(sr, o, w, m, voices, channels, 1, 0xffff, results);
+        // 4 voices of 8 sub-oscillators each
+        for (uint8_t o = KanonCore::POLYBLEP; o <= KanonCore::WAVETABLE; o++)
+            for (uint8_t w = KanonCore::SINE; w <= KanonCore::SAW; w++)
+                benchKanon(sr, o, w, KanonCore::KANON, 4, 1, 8, 0xffff, results);
+        // only the first voice's output patched
+        for (uint8_t o = KanonCore::POLYBLEP; o <= KanonCore::WAVETABLE; o++)
+            for (uint8_t w = KanonCore::SINE; w <= KanonCore::SAW; w++)
+                for (int voices : { 4, 16 })
+                    benchKanon(sr, o, w, KanonCore::KANON, voices, 1, 1, 0x1, results);
+        for (uint8_t i = TerminalCore::LINEAR; i <= TerminalCore::ALLPASS; i++)
+            for (bool dual_head : { false, true })
+                for (uint8_t storage : { STORAGE_FLOAT, STORAGE_COMPACT })
+                    for (int config = 0; config < DELAY_CONFIGS_LEN; config++)
+                        for (int voices : { 1, 16 })
+                            benchTerminal(sr, i, dual_head, storage, config, voices, results);
+    }
+
+    int regressions = 0;
+    int missing = 0;
+    for (const Result& r : results) {
+        std::printf("%-44s %9.2f ns/sample %13.0f samples/s", r.name.c_str(), r.ns_per_sample, 1e9 / r.ns_per_sample);
+        auto b = baseline.find(r.name);
+        if (b != baseline.end()) {
+            double change = r.ns_per_sample / b->second - 1.0;
+            std::printf(" %+7.1f%%", 100.0 * change);
+            if (change > tolerance) {
+                std::printf("  REGRESSION");
+                regressions++;
+            }
+        }
+        // a case added since the baseline was recorded would otherwise never be compared
+        else if (compare) {
+            std::printf("  NOT IN BASELINE");
+            missing++;
+        }
+        std::printf("\n");
+    }
+
+    if (write_path) {
+        FILE* f = std::fopen(write_path, "w");
+        if (!f) {
+            std::fprintf(stderr, "can't write baseline to %s\n", write_path);
+            return 2;
+        }
+        for (const Result& r : results) std::fprintf(f, "%s %.3f\n", r.name.c_str(), r.ns_per_sample);
+        std::fclose(f);
+    }
+
+    if (baseline_path && !compare)
+        std::fprintf(stderr, "no baseline in %s, skipping the comparison; record one with --write-baseline (make bench-baseline)\n", baseline_path);
+    if (regressions)
+        std::fprintf(stderr, "%d case(s) more than %.0f%% slower than the baseline\n", regressions, 100.0 * tolerance);
+    if (missing)
+        std::fprintf(stderr, "%d case(s) missing from the baseline; record a new one with --write-baseline (make bench-baseline)\n", missing);
+    return regressions || missing ? 1 : 0;
+}
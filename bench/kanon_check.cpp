@@ -0,0 +1,71 @@
+// Checks that KanonCore's pitch assignment keeps going to voices that exist
+// and are patched, as the canon depth and the patched outputs change while
+// notes keep coming in. Build and run with `make check`; exits with 1 if a
+// note goes anywhere else.
+#include <cstdio>
+#include "../src/kanon_core.hpp"
+
+static const float SAMPLE_RATE = 48000.f;
+
+static int failures = 0;
+
+static void expect(bool ok, const char* what, int mode, int note)
+{
+    if (ok) return;
+    std::printf("mode %d, note %d: %s  FAIL\n", mode, note, what);
+    failures++;
+}
+
+// Plays n notes, each held for a few samples so that it gets assigned, and
+// checks where each one went.
+static void play(KanonCore& core, int mode, int n, int& note)
+{
+    float vocts[16] = {};
+    float out[16 * KanonCore::MAX_VOICES];
+    for (int i = 0; i < n; i++, note++) {
+        vocts[0] = (note % 24) / 12.f - 1.f;
+        for (int f = 0; f < 4; f++) core.process(0.f, 1.f / SAMPLE_RATE, vocts, out);
+        int v = core.newestVoice(0);
+        expect(v >= 0 && v < core.voices, "newest pitch went to a voice beyond the canon depth", mode, note);
+        expect(v >= 0 && (core.active & (1 << v)), "newest pitch went to an unpatched voice", mode, note);
+        expect(v >= 0 && v < KanonCore::MAX_VOICES && core.voicePitch(0, v) == vocts[0], "newest voice doesn't play the newest pitch", mode, note);
+    }
+}
+
+int main()
+{
+    for (int mode = KanonCore::KANON; mode <= KanonCore::RND; mode++) {
+        KanonCore core;
+        core.setMode(mode);
+        core.setVoices(16);
+        core.setActive(0xffff);
+        int note = 0;
+
+        // let the master voice move well past voice 4, then lower the depth under it
+        play(core, mode, 11, note);
+        core.setVoices(4);
+        play(core, mode, 20, note);
+
+        // back up, and down again with the master on the last voice
+        core.setVoices(16);
+        play(core, mode, 15, note);
+        core.setVoices(3);
+        play(core, mode, 20, note);
+
+        // unpatch the master voice, and all voices but one
+        core.setVoices(8);
+        core.setActive(0xff);
+        play(core, mode, 5, note);
+        core.setActive(0xff & ~(1 << core.newestVoice(0)));
+        play(core, mode, 20, note);
+        core.setActive(0x4);
+        play(core, mode, 5, note);
+    }
+
+    if (failures) {
+        std::fprintf(stderr, "%d note(s) went astray\n", failures);
+        return 1;
+    }
+    std::printf("pitch assignment ok in every mode\n");
+    return 0;
+}
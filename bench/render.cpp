@@ -0,0 +1,497 @@
+// Offline render of a patch full of Kanon and Terminal instances, for
+// capacity planning and as a regression gate at the scale of a whole rig
+// rather than of a single core.
+//
+// Every frame is stepped the way Rack's engine steps a patch: the worker
+// threads take instances off a shared counter until none are left, then
+// all wait at a barrier for the next frame. So the cost of keeping the
+// threads in step, and of the instances' memory competing for the caches,
+// shows up just as it would in Rack. The render is repeated on 1 to N
+// threads, for a scaling curve, with N no more than there are cores: like
+// Rack's, the threads only ever make sense one per core.
+// Build and run with `make render`.
+//
+//     render                         16 Kanons and 16 Terminals, on 1 to all cores
+//     render --kanons N              number of instances of each module
+//     render --terminals N
+//     render --threads N             up to N threads, default and at most: one per core
+//     render --seconds S             audio rendered per run, default 1
+//     render --rate SR               engine sample rate, default 48000
+//     render --voct FILE             drive Kanon's 1V/oct input with FILE, raw
+//                                    32-bit floats at the engine rate, looped
+//     render --audio FILE            and Terminal's IN, likewise
+//     render --baseline FILE         also compare against FILE, and exit with
+//                                    1 if any thread count got slower than allowed
+//                                    or is missing from it; without a baseline
+//                                    in FILE, only print the results
+//     render --write-baseline FILE   save the results as the new baseline
+//     render --tolerance X           allowed slowdown, default 0.1 (10%)
+//
+// Without recordings, Kanon gets a new note every 1/8 s and Terminal noise,
+// each instance its own. Every Terminal channel's Departures are patched
+// back into its Arrivals, so that its loops fill up and keep running.
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#include "../src/control_rate.hpp"
+#include "../src/kanon_core.hpp"
+#include "../src/terminal_core.hpp"
+
+
+// runs per thread count (the fastest one counts)
+static const int RUNS = 3;
+
+// keeps the compiler from optimizing the work away
+static volatile float sink;
+
+
+/*==- INSTANCES -==*/
+
+// one module in the patch, as Rack's engine sees it
+struct Instance {
+    virtual ~Instance() {}
+    virtual void process(long frame) = 0;
+    // memory of its own, in bytes
+    virtual size_t bytes() const = 0;
+};
+
+// A signal to drive an input with: a recording, looped, or a synthetic one.
+struct Source {
+    std::vector<float> samples;
+
+    float at(long frame) const
+    {
+        return samples[frame % samples.size()];
+    }
+};
+
+struct KanonInstance : Instance {
+    KanonCore core;
+    const Source& voct;
+    // an offset into voct, so that no two instances play the same notes at once
+    long offset;
+    float sample_time;
+    float vocts[16] = {};
+    float out[16 * KanonCore::MAX_VOICES];
+
+    // a different waveshape, mode and depth each, as in a real patch
+    KanonInstance(int index, float sr, const Source& v)
+        : voct(v), offset(index * 1009), sample_time(1.f / sr)
+    {
+        core.setOscillator(index % 5 == 4 ? KanonCore::WAVETABLE : KanonCore::POLYBLEP);
+        core.setWaveshape(index % 4);
+        core.setMode(index / 4 % 4);
+        core.setVoices(4 << (index % 3 == 2));
+        // as if the poly output were patched, so every voice is computed
+        core.setActive(0xffff);
+    }
+
+    void process(long frame) override
+    {
+        vocts[0] = voct.at(frame + offset);
+        core.process(0.f, sample_time, vocts, out);
+        sink = out[0];
+    }
+
+    size_t bytes() const override
+    {
+        return sizeof(*this);
+    }
+};
+
+struct TerminalInstance : Instance {
+    TerminalCore core;
+    const Source& audio;
+    long offset;
+    float input[2][TerminalCore::LANES] = {};
+    float arrival[2][TerminalCore::LANES] = {};
+    float gain[TerminalCore::LANES];
+    float delay_time[TerminalCore::LANES];
+    float departure[2][TerminalCore::LANES] = {};
+
+    // one voice per channel, at delay times and interpolations of its own
+    TerminalInstance(int index, float sr, const Source& a)
+        : audio(a), offset(index * 7919)
+    {
+        core.setInterpolation(index % 3);
+        core.setStorage(index % 4 == 3 ? STORAGE_COMPACT : STORAGE_FLOAT);
+        core.setSampleRate(sr);
+        for (int i = 0; i < TERMINAL_CHANNELS; i++) core.setVoices(i, 1);
+        // what the module's worker thread does, done up front
+        core.swapBuffers();
+        core.prepareBuffers();
+        core.swapBuffers();
+        std::fill(gain, gain + TerminalCore::LANES, 0.7f);
+        for (int lane = 0; lane < TerminalCore::LANES; lane++) delay_time[lane] = 0.05f + 0.9f * ((index * 3 + lane) % 7) / 7.f;
+    }
+
+    void process(long frame) override
+    {
+        if (frame % CONTROL_DIVISION == 0) core.swapBuffers();
+        int lanes = core.layout.lanes;
+        for (int lane = 0; lane < lanes; lane++) {
+            input[0][lane] = audio.at(frame + offset);
+            input[1][lane] = audio.at(frame + offset + 1);
+            // the Departures patched back into the Arrivals
+            arrival[0][lane] = departure[0][lane];
+            arrival[1][lane] = departure[1][lane];
+        }
+        core.process(input, arrival, gain, delay_time, departure);
+        sink = departure[0][0];
+    }
+
+    size_t bytes() const override
+    {
+        return sizeof(*this) + core.memoryBytes();
+    }
+};
+
+
+/*==- ENGINE -==*/
+
+// Keeps the threads in step from one frame to the next, like Rack's: it
+// spins, since a frame is over far sooner than a thread would wake up.
+// Spinning only pays with a core per thread, see main(); with more threads
+// than that, yielding at least lets the one that's behind catch up. (A
+// bounded spin before it, or sleeping on a condition variable after it,
+// measured slower there still.)
+struct Barrier {
+    int threads;
+    std::atomic<int> waiting{0};
+    std::atomic<uint32_t> generation{0};
+
+    explicit Barrier(int t) : threads(t) {}
+
+    void wait()
+    {
+        uint32_t g = generation.load(std::memory_order_acquire);
+        if (waiting.fetch_add(1, std::memory_order_acq_rel) + 1 == threads) {
+            waiting.store(0, std::memory_order_relaxed);
+            generation.fetch_add(1, std::memory_order_release);
+            return;
+        }
+        while (generation.load(std::memory_order_acquire) == g) std::this_thread::yield();
+    }
+};
+
+// Renders frames of the patch on the given number of threads, the calling
+// one included, and returns how long it took, in seconds.
+static double render(std::vector<std::unique_ptr<Instance>>& patch, long frames, int threads)
+{
+    Barrier start(threads), done(threads);
+    std::atomic<size_t> next{0};
+    std::atomic<bool> running{true};
+    long frame = 0;
+
+    // every frame: take instances until there are none left, then wait for the others
+    auto step = [&]() {
+        for (size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < patch.size();)
+            patch[i]->process(frame);
+        done.wait();
+    };
+    auto worker = [&]() {
+        while (true) {
+            start.wait();
+            if (!running.load(std::memory_order_acquire)) return;
+            step();
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (int t = 1; t < threads; t++) workers.emplace_back(worker);
+
+    auto begin = std::chrono::steady_clock::now();
+    for (frame = 0; frame < frames; frame++) {
+        next.store(0, std::memory_order_relaxed);
+        start.wait();
+        step();
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    running.store(false, std::memory_order_release);
+    start.wait();
+    for (std::thread& w : workers) w.join();
+    return std::chrono::duration<double>(end - begin).count();
+}
+
+
+/*==- CACHE COUNTERS -==*/
+
+// Last-level cache references and misses of this process and the threads
+// it starts, from the kernel's perf events. Only on Linux, and only where
+// perf_event_paranoid allows it; available() says whether they're counting.
+struct CacheCounters {
+    int fd[2] = { -1, -1 };
+
+    CacheCounters()
+    {
+#ifdef __linux__
+        const uint64_t configs[2] = { PERF_COUNT_HW_CACHE_REFERENCES, PERF_COUNT_HW_CACHE_MISSES };
+        for (int k = 0; k < 2; k++) {
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = configs[k];
+            attr.disabled = 1;
+            attr.inherit = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            fd[k] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+        }
+#endif
+    }
+
+    ~CacheCounters()
+    {
+#ifdef __linux__
+        for (int f : fd) if (f >= 0) close(f);
+#endif
+    }
+
+    bool available() const
+    {
+        return fd[0] >= 0 && fd[1] >= 0;
+    }
+
+    void start()
+    {
+#ifdef __linux__
+        for (int f : fd) {
+            if (f < 0) continue;
+            ioctl(f, PERF_EVENT_IOC_RESET, 0);
+            ioctl(f, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    // references and misses since start()
+    void stop(uint64_t& references, uint64_t& misses)
+    {
+        uint64_t counts[2] = {};
+#ifdef __linux__
+        for (int k = 0; k < 2; k++) {
+            if (fd[k] < 0) continue;
+            ioctl(fd[k], PERF_EVENT_IOC_DISABLE, 0);
+            if (read(fd[k], &counts[k], sizeof(uint64_t)) != sizeof(uint64_t)) counts[k] = 0;
+        }
+#endif
+        references = counts[0];
+        misses = counts[1];
+    }
+};
+
+// the last-level cache's size in bytes, or 0 if unknown
+static size_t lastLevelCache()
+{
+    size_t size = 0;
+#ifdef __linux__
+    for (int index = 0; index < 8; index++) {
+        FILE* f = std::fopen(("/sys/devices/system/cpu/cpu0/cache/index" + std::to_string(index) + "/size").c_str(), "r");
+        if (!f) break;
+        unsigned long kb;
+        if (std::fscanf(f, "%luK", &kb) == 1) size = std::max(size, (size_t) kb * 1024);
+        std::fclose(f);
+    }
+#endif
+    return size;
+}
+
+
+/*==- ------------- -==*/
+
+static bool readSource(const char* path, Source& source)
+{
+    FILE* f = std::fopen(path, "rb");
+    if (!f) return false;
+    float buffer[4096];
+    size_t n;
+    while ((n = std::fread(buffer, sizeof(float), 4096, f)) > 0) source.samples.insert(source.samples.end(), buffer, buffer + n);
+    std::fclose(f);
+    return !source.samples.empty();
+}
+
+// False if there's no baseline to read, and so nothing to compare against.
+static bool readBaseline(const char* path, std::map<std::string, double>& baseline)
+{
+    FILE* f = std::fopen(path, "r");
+    if (!f) return false;
+    char name[256];
+    double ns;
+    while (std::fscanf(f, "%255s %lf", name, &ns) == 2) baseline[name] = ns;
+    std::fclose(f);
+    return !baseline.empty();
+}
+
+int main(int argc, char** argv)
+{
+    int kanons = 16, terminals = 16;
+    int cores = std::max(1u, std::thread::hardware_concurrency());
+    int max_threads = cores;
+    float seconds = 1.f, sr = 48000.f;
+    const char* voct_path = nullptr;
+    const char* audio_path = nullptr;
+    const char* baseline_path = nullptr;
+    const char* write_path = nullptr;
+    double tolerance = 0.1;
+
+    for (int a = 1; a < argc; a++) {
+        if (!std::strcmp(argv[a], "--kanons") && a + 1 < argc) kanons = std::atoi(argv[++a]);
+        else if (!std::strcmp(argv[a], "--terminals") && a + 1 < argc) terminals = std::atoi(argv[++a]);
+        else if (!std::strcmp(argv[a], "--threads") && a + 1 < argc) max_threads = std::max(1, std::atoi(argv[++a]));
+        else if (!std::strcmp(argv[a], "--seconds") && a + 1 < argc) seconds = std::atof(argv[++a]);
+        else if (!std::strcmp(argv[a], "--rate") && a + 1 < argc) sr = std::atof(argv[++a]);
+        else if (!std::strcmp(argv[a], "--voct") && a + 1 < argc) voct_path = argv[++a];
+        else if (!std::strcmp(argv[a], "--audio") && a + 1 < argc) audio_path = argv[++a];
+        else if (!std::strcmp(argv[a], "--baseline") && a + 1 < argc) baseline_path = argv[++a];
+        else if (!std::strcmp(argv[a], "--write-baseline") && a + 1 < argc) write_path = argv[++a];
+        else if (!std::strcmp(argv[a], "--tolerance") && a + 1 < argc) tolerance = std::atof(argv[++a]);
+        else {
+            std::fprintf(stderr, "usage: %s [--kanons N] [--terminals N] [--threads N] [--seconds S] [--rate SR]\n"
+                "    [--voct FILE] [--audio FILE] [--baseline FILE] [--write-baseline FILE] [--tolerance X]\n", argv[0]);
+            return 2;
+        }
+    }
+    // more threads than cores only measure the threads taking turns
+    if (max_threads > cores) {
+        std::fprintf(stderr, "only %d core(s), rendering on up to %d thread(s)\n", cores, cores);
+        max_threads = cores;
+    }
+    long frames = (long) (seconds * sr);
+    if (frames <= 0 || sr <= 0.f || kanons < 0 || terminals < 0 || kanons + terminals == 0) {
+        std::fprintf(stderr, "nothing to render\n");
+        return 2;
+    }
+
+    // timings only compare on the same machine, so a fresh checkout has none
+    std::map<std::string, double> baseline;
+    bool compare = baseline_path && readBaseline(baseline_path, baseline);
+
+    Source voct, audio;
+    if (voct_path && !readSource(voct_path, voct)) {
+        std::fprintf(stderr, "can't read 1V/oct from %s\n", voct_path);
+        return 2;
+    }
+    if (audio_path && !readSource(audio_path, audio)) {
+        std::fprintf(stderr, "can't read audio from %s\n", audio_path);
+        return 2;
+    }
+    // a new note every 1/8 s, and noise, a few seconds of each
+    if (voct.samples.empty()) {
+        voct.samples.resize((size_t) (4 * sr));
+        for (size_t f = 0; f < voct.samples.size(); f++) voct.samples[f] = ((f / (int) (sr / 8)) * 7 % 24) / 12.f - 1.f;
+    }
+    if (audio.samples.empty()) {
+        audio.samples.resize((size_t) (4 * sr) + 1);
+        uint32_t x = 1;
+        for (float& s : audio.samples) {
+            x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+            s = (x / 4294967296.f - 0.5f) * 10.f;
+        }
+    }
+
+    // interleaved, as they'd be in a patch
+    std::vector<std::unique_ptr<Instance>> patch;
+    size_t kanon_bytes = 0, terminal_bytes = 0;
+    for (int i = 0; i < std::max(kanons, terminals); i++) {
+        if (i < kanons) {
+            patch.emplace_back(new KanonInstance(i, sr, voct));
+            kanon_bytes += patch.back()->bytes();
+        }
+        if (i < terminals) {
+            patch.emplace_back(new TerminalInstance(i, sr, audio));
+            terminal_bytes += patch.back()->bytes();
+        }
+    }
+    // shared by every Kanon on the wavetable oscillator
+    size_t shared_bytes = kanons > 4 ? sizeof(Wavetable) : 0;
+    size_t total = kanon_bytes + terminal_bytes + shared_bytes;
+    size_t llc = lastLevelCache();
+
+    std::printf("%d Kanon, %d Terminal instances; %.0f Hz, %g s per run\n", kanons, terminals, sr, seconds);
+    std::printf("memory: Kanon %.1f kB each, Terminal %.2f MB each, %.1f kB of shared tables; %.1f MB in all",
+        kanons ? kanon_bytes / 1e3 / kanons : 0.0, terminals ? terminal_bytes / 1e6 / terminals : 0.0, shared_bytes / 1e3, total / 1e6);
+    if (llc) std::printf(", %.1f times the last-level cache", (double) total / llc);
+    std::printf("\n\n");
+
+    CacheCounters counters;
+    std::printf("%-8s %12s %10s %8s %11s %14s %10s\n", "threads", "x realtime", "speedup", "eff.", "ns/frame", "LLC misses/f", "miss rate");
+
+    std::vector<std::pair<std::string, double>> results;
+    int regressions = 0;
+    int missing = 0;
+    double single = 0.0;
+
+    for (int threads = 1; threads <= max_threads; threads++) {
+        double best = 1e30;
+        uint64_t references = 0, misses = 0;
+        for (int r = 0; r < RUNS; r++) {
+            uint64_t run_references, run_misses;
+            counters.start();
+            double s = render(patch, frames, threads);
+            counters.stop(run_references, run_misses);
+            if (s < best) {
+                best = s;
+                references = run_references;
+                misses = run_misses;
+            }
+        }
+        double ns = best * 1e9 / frames;
+        if (threads == 1) single = ns;
+
+        std::printf("%-8d %12.1f %9.2fx %7.0f%% %11.0f", threads, seconds / best, single / ns, 100.0 * single / ns / threads, ns);
+        if (counters.available()) std::printf(" %14.0f %9.1f%%", (double) misses / frames, references ? 100.0 * misses / references : 0.0);
+        else std::printf(" %14s %10s", "n/a", "n/a");
+
+        char name[128];
+        std::snprintf(name, sizeof(name), "render/%dk/%dt/%dthreads/%d", kanons, terminals, threads, (int) sr);
+        results.push_back({ name, ns });
+        auto b = baseline.find(name);
+        if (b != baseline.end()) {
+            double change = ns / b->second - 1.0;
+            std::printf(" %+7.1f%%", 100.0 * change);
+            if (change > tolerance) {
+                std::printf("  REGRESSION");
+                regressions++;
+            }
+        }
+        // recorded on a machine with fewer cores, or for another patch
+        else if (compare) {
+            std::printf("  NOT IN BASELINE");
+            missing++;
+        }
+        std::printf("\n");
+    }
+
+    if (write_path) {
+        FILE* f = std::fopen(write_path, "w");
+        if (!f) {
+            std::fprintf(stderr, "can't write baseline to %s\n", write_path);
+            return 2;
+        }
+        for (const auto& r : results) std::fprintf(f, "%s %.3f\n", r.first.c_str(), r.second);
+        std::fclose(f);
+    }
+
+    if (baseline_path && !compare)
+        std::fprintf(stderr, "no baseline in %s, skipping the comparison; record one with --write-baseline (make render-baseline)\n", baseline_path);
+    if (regressions)
+        std::fprintf(stderr, "%d thread count(s) more than %.0f%% slower than the baseline\n", regressions, 100.0 * tolerance);
+    if (missing)
+        std::fprintf(stderr, "%d thread count(s) missing from the baseline; record a new one with --write-baseline (make render-baseline)\n", missing);
+    return regressions || missing ? 1 : 0;
+}
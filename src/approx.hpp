@@ -0,0 +1,88 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <simd/Vector.hpp>
+#include <simd/functions.hpp>
+
+// Fast polynomial replacements for the libm calls on Kanon's and Terminal's audio paths.
+// Every function comes in a scalar and a simd::float_4 flavour so they
+// can be dropped into either kind of kernel.
+//
+// Coefficients were fitted as (near-)minimax polynomials with Lawson's
+// iteratively reweighted least squares; the error bounds below were then
+// measured in single precision against the double-precision libm results.
+namespace approx {
+
+using rack::simd::float_4;
+using rack::simd::int32_4;
+
+// 2^f for f in [0, 1). Max relative error 7.5e-8 in exact arithmetic.
+template <typename T>
+inline T exp2_fract(T f)
+{
+    return 0.9999999251f + f * (0.6931530732f + f * (0.2401536174f
+        + f * (0.05582631699f + f * (0.008989341359f + f * 0.001877576150f))));
+}
+
+// 2^x, split into an exponent written straight into the float bits and a
+// polynomial for the fractional part. Valid for |x| < 126.
+// Max relative error 1.8e-7 over [-16, 16] (the full +-10V input range plus
+// the coarse/fine offsets), i.e. 0.0003 cents when used as volt2freq().
+inline float exp2(float x)
+{
+    float xi = std::floor(x);
+    float y = exp2_fract(x - xi);
+    int32_t bits;
+    std::memcpy(&bits, &y, sizeof(bits));
+    bits += (int32_t) xi * (1 << 23);
+    std::memcpy(&y, &bits, sizeof(y));
+    return y;
+}
+
+inline float_4 exp2(float_4 x)
+{
+    float_4 xi = rack::simd::floor(x);
+    float_4 y = exp2_fract(x - xi);
+    return float_4::cast(int32_4::cast(y) + (int32_4(xi) << 23));
+}
+
+// sin(2*pi*x) for x in [-0.25, 0.25], odd polynomial of degree 7.
+template <typename T>
+inline T sin2pi_quarter(T x)
+{
+    T x2 = x * x;
+    return x * (6.283164044f + x2 * (-41.33714236f + x2 * (81.34076868f + x2 * -70.99343133f)));
+}
+
+// sin(2*pi*phase) for any phase. Max absolute error 7.4e-7 over [-3, 3],
+// i.e. -122 dB relative to full scale.
+inline float sin2pi(float phase)
+{
+    float x = phase - std::floor(phase + 0.5f);
+    // fold [-0.5, 0.5] onto [-0.25, 0.25] using sin(pi - a) = sin(a)
+    if (x > 0.25f) x = 0.5f - x;
+    else if (x < -0.25f) x = -0.5f - x;
+    return sin2pi_quarter(x);
+}
+
+inline float_4 sin2pi(float_4 phase)
+{
+    float_4 x = phase - rack::simd::floor(phase + 0.5f);
+    x = rack::simd::ifelse(x > 0.25f, 0.5f - x, x);
+    x = rack::simd::ifelse(x < -0.25f, -0.5f - x, x);
+    return sin2pi_quarter(x);
+}
+
+// Soft clipper shaped like tanh(x): the [3/2] Pade approximant
+// x * (27 + x^2) / (27 + 9 x^2), which reaches exactly +-1 at |x| = 3 with
+// zero slope, and is held there beyond. Max absolute error 0.024 against tanh,
+// and smooth, which is all a saturator needs.
+template <typename T>
+inline T softclip(T x)
+{
+    x = rack::simd::fmin(rack::simd::fmax(x, -3.f), 3.f);
+    T x2 = x * x;
+    return x * (27.f + x2) / (27.f + 9.f * x2);
+}
+
+} // namespace approx
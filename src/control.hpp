@@ -0,0 +1,48 @@
+#pragma once
+#include <rack.hpp>
+#include "control_rate.hpp"
+
+// Control-rate layer shared by all modules: params, buttons and lights are
+// only looked at once every CONTROL_DIVISION samples, and whatever the audio
+// kernels need from them is handed over as a linear ramp, so the per-sample
+// path only ever touches precomputed values.
+
+struct ControlClock : dsp::ClockDivider {
+    ControlClock()
+    {
+        setDivision(CONTROL_DIVISION);
+        // tick on the very first sample, so nothing runs on unset controls
+        clock = CONTROL_DIVISION - 1;
+    }
+};
+
+// Moves linearly to the target given on each control tick, reaching it
+// exactly CONTROL_DIVISION process() calls later, i.e. on the next tick.
+template <typename T = float>
+struct LinearRamp {
+    T value = 0.f;
+    T step = 0.f;
+    bool started = false;
+
+    void setTarget(T target)
+    {
+        // jump straight to the first target instead of ramping up from 0
+        if (!started) {
+            value = target;
+            started = true;
+        }
+        step = (target - value) * (1.f / CONTROL_DIVISION);
+    }
+
+    void reset()
+    {
+        started = false;
+        step = 0.f;
+    }
+
+    inline T process()
+    {
+        value += step;
+        return value;
+    }
+};
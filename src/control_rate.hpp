@@ -0,0 +1,9 @@
+#pragma once
+#include <cstdint>
+
+// Control-rate constants, kept apart from control.hpp so that
+// bench/render.cpp can step the cores at the modules' control rate
+// without including Rack.
+
+// How often the modules look at their params, buttons and lights, in samples
+static const uint32_t CONTROL_DIVISION = 32;
@@ -1,7 +1,25 @@
+#include <atomic>
 #include <vector>
 #include "plugin.hpp"
 #include "widgets.hpp"
-
+#include "control.hpp"
+#include "telemetry.hpp"
+#include "kanon_core.hpp"
+
+
+// what Kanon publishes every TELEMETRY_WINDOW frames
+struct KanonTelemetry {
+    // counts up by one per window, so that a log shows any it skipped
+    uint32_t window;
+    ProcessTime time;
+    int channels;
+    int voices;
+    uint16_t active;
+    // per channel, the voice its newest pitch went to (-1 if none), and
+    // the pitch each voice plays, in volts
+    int8_t newest[16];
+    float pitch[16][KanonCore::MAX_VOICES];
+};
 
 struct Kanon : Module {
     enum ParamId {
@@ -23,6 +41,7 @@ struct Kanon : Module {
     enum InputId {
         VOCT_INPUT,
         FINE_INPUT,
+        SPREAD_INPUT,
         INPUTS_LEN
     };
     enum OutputId {
@@ -30,6 +49,7 @@ struct Kanon : Module {
         VOICE2_OUTPUT,
         VOICE3_OUTPUT,
         VOICE4_OUTPUT,
+        POLY_OUTPUT,
         OUTPUTS_LEN
     };
     enum LightId {
@@ -42,39 +62,39 @@ struct Kanon : Module {
         MODE_FWDFWD_LIGHT,
         MODE_FWDBWD_LIGHT,
         MODE_RND_LIGHT,
+
+        VOICE1_LIGHT,
+        VOICE2_LIGHT,
+        VOICE3_LIGHT,
+        VOICE4_LIGHT,
         LIGHTS_LEN
     };
 
-    float phases[4] = { 0.f, 0.f, 0.f, 0.f };
-    float vocts[4] = { 0.f, 0.f, 0.f, 0.f };
     dsp::BooleanTrigger waveshape_trigger;
     dsp::BooleanTrigger mode_trigger;
-
-    enum Waveshape {
-        SINE,
-        TRIANGLE,
-        SQUARE,
-        SAW
-    };
-
-    enum Mode {
-        KANON,
-        FWDFWD,
-        FWDBWD,
-        RND
-    };
-
-    // Used only in forward-backward mode
-    enum Order {
-        RIGHT,
-        LEFT
-    };
-
-    uint8_t waveshape;
-    uint8_t mode;
-    uint8_t master_voice;
-    uint8_t order;
-    float last_voct;
+    ControlClock control;
+    // coarse + fine, in volts
+    LinearRamp<> pitch_ramp;
+
+    KanonCore core;
+    // Set from the UI thread, and handed over to core by processControls(),
+    // so that the kernel never changes under a process() call.
+    std::atomic<uint8_t> requested_oscillator{KanonCore::POLYBLEP};
+    std::atomic<int> requested_voices{4};
+    std::atomic<int> requested_unison{1};
+    // unison detune, from 0 to 1, i.e. up to a semitone either way for the
+    // outermost sub-oscillators; set in the context menu, added to by CV
+    float spread = DEFAULT_SPREAD;
+    // 20 cents
+    static constexpr float DEFAULT_SPREAD = 0.2f;
+    // voice v of channel c is at c * MAX_VOICES + v
+    float voice_buffer[16 * KanonCore::MAX_VOICES] = {};
+
+    // see KanonTelemetry
+    Snapshot<KanonTelemetry> telemetry;
+    ProcessTimer timer;
+    int frames = 0;
+    uint32_t window = 0;
 
     Kanon() {
         config(PARAMS_LEN, INPUTS_LEN, OUTPUTS_LEN, LIGHTS_LEN);
@@ -88,7 +108,8 @@ struct Kanon : Module {
         configButton(MODE_FWDBWD_PARAM, "Forward-backward mode");
         configButton(MODE_FWDFWD_PARAM, "Forward-forward mode");
         configButton(MODE_RND_PARAM, "Random mode");
-        configInput(VOCT_INPUT, "1V/octave");
+        configInput(VOCT_INPUT, "1V/octave (polyphonic)");
+        configInput(SPREAD_INPUT, "Unison spread CV (polyphonic)");
 
         configLight(WAVEFORM_SINE_LIGHT);
         configLight(WAVEFORM_TRIANGLE_LIGHT);
@@ -104,57 +125,43 @@ struct Kanon : Module {
         configOutput(VOICE2_OUTPUT, "Voice 2");
         configOutput(VOICE3_OUTPUT, "Voice 3");
         configOutput(VOICE4_OUTPUT, "Voice 4");
+        configOutput(POLY_OUTPUT, "All voices (polyphonic)");
 
-        setWaveshape(SINE);
-        setMode(KANON);
+        for (uint8_t voice = 0; voice < 4; voice++)
+            configLight(VOICE1_LIGHT + voice, string::f("Voice %d active (brightest: took the newest pitch)", voice + 1));
 
-        master_voice = 0;
-        order = RIGHT;
-        last_voct = 0.f;
+        core.seed(random::u32());
+        setWaveshape(KanonCore::SINE);
+        setMode(KanonCore::KANON);
     }
 
     void setWaveshape(uint8_t w)
     {
-        waveshape = w;
-        for (uint8_t l = SINE; l <= SAW; l++) lights[l + WAVEFORM_SINE_LIGHT].setBrightness(0.f);
+        core.setWaveshape(w);
+        for (uint8_t l = KanonCore::SINE; l <= KanonCore::SAW; l++) lights[l + WAVEFORM_SINE_LIGHT].setBrightness(0.f);
         lights[w + WAVEFORM_SINE_LIGHT].setBrightness(1.f);
     }
-    void setMode(uint8_t m)
-    {
-        mode = m;
-        if (m == KANON) master_voice = 0;
-        for (uint8_t l = KANON; l <= RND; l++) lights[l + MODE_KANON_LIGHT].setBrightness(0.f);
-        lights[m + MODE_KANON_LIGHT].setBrightness(1.f);
-    }
-
-    /*==- WAVESHAPE FUNCTIONS -==*/
-    // Might look into more efficient ways to evaluate
-    // in the future (e.g. recursive oscillators, alike
-    // Bogaudio although for some reason they sound weird!).
-    inline float sine(float phase)
+    // UI thread. Builds the wavetables, if need be, so the audio thread doesn't have to.
+    void setOscillator(uint8_t o)
     {
-        return std::sin(2.f * M_PI * phase);
+        o = std::min(o, (uint8_t) KanonCore::WAVETABLE);
+        if (o == KanonCore::WAVETABLE) Wavetable::get();
+        requested_oscillator.store(o, std::memory_order_release);
     }
-
-    inline float triangle(float phase)
-    {
-        return 2.f * std::abs(2.f*(phase - std::floor(phase + 0.5f))) - 1;
-    }
-
-    inline float square(float phase)
+    void setMode(uint8_t m)
     {
-        return phase > 0.5? 1.f : -1.f;
+        core.setMode(m);
+        for (uint8_t l = KanonCore::KANON; l <= KanonCore::RND; l++) lights[l + MODE_KANON_LIGHT].setBrightness(0.f);
+        lights[m + MODE_KANON_LIGHT].setBrightness(1.f);
     }
-
-    inline float saw(float phase)
+    // UI thread, as is setUnison()
+    void setVoices(int n)
     {
-        return 2.f*phase - 1;
+        requested_voices.store(clamp(n, 1, (int) KanonCore::MAX_VOICES), std::memory_order_release);
     }
-    /*==- ------------------- -==*/
-
-    inline float volt2freq(float v)
+    void setUnison(int n)
     {
-        return dsp::FREQ_C4 * std::pow(2, v);
+        requested_unison.store(clamp(n, 1, (int) KanonCore::MAX_UNISON), std::memory_order_release);
     }
 
     inline float current_pitch()
@@ -163,110 +170,111 @@ struct Kanon : Module {
         + params[FINE_PARAM].getValue() / 12.0f;
     }
 
-    void process(const ProcessArgs& args) override
+    void processControls()
     {
+        // settings from the context menu
+        uint8_t o = requested_oscillator.load(std::memory_order_acquire);
+        if (o != core.oscillator) core.setOscillator(o);
+        int n = requested_voices.load(std::memory_order_acquire);
+        if (n != core.voices) core.setVoices(n);
+        int u = requested_unison.load(std::memory_order_acquire);
+        if (u != core.unison) core.setUnison(u);
+
         // handle waveform buttons
-        for (uint8_t w = SINE; w <= SAW; w++)
+        for (uint8_t w = KanonCore::SINE; w <= KanonCore::SAW; w++)
             if (waveshape_trigger.process(params[w + WAVEFORM_SINE_PARAM].getValue())) {
                 setWaveshape(w);
                 break;
             }
         // handle mode buttons
-        for (uint8_t m = KANON; m <= RND; m++)
+        for (uint8_t m = KanonCore::KANON; m <= KanonCore::RND; m++)
             if (mode_trigger.process(params[m + MODE_KANON_PARAM].getValue())) {
                 setMode(m);
                 break;
             }
 
-        /*
-        ... if the voltage of master pitch is the same as last frame:
-
-        KANON MODE:
-            let voice 4 play voice 3 pitch
-            let voice 3 play voice 2 pitch
-            let voice 2 play the last voice 1 pitch
-            set the last voice 1 pitch to the current input pitch
-
-        FWD-FWD MODE: (assume <master> voice)
-            set master voice to current input pitch
-            master voice = (master voice + 1) % 4
-
-        FWD-BWD MODE: (assume <master> voice)
-            set master voice to current input pitch
-            if order=left:
-                master voice -= 1
-                if master voice = 0: order=right
-            else:
-                master voice += 1
-                if master voice = 3: order=left
-
-        Something to think about is whether we should keep track of what outputs
-        are connected and only count those voices to whatever pitch assignment
-        algorithm we're using. For now we don't --- I don't think that that's
-        as big of a worry as it seems, but in the future we can work on that.
-        Maybe even make little lights next to each output to let the user know
-        we're thinking about them!
-        */
-
-        // process pitch change
-        if (inputs[VOCT_INPUT].getVoltage() == last_voct && inputs[VOCT_INPUT].getVoltage() != vocts[master_voice]) {
-            switch (mode)
-            {
-                case KANON: {
-                    vocts[3] = vocts[2];
-                    vocts[2] = vocts[1];
-                    vocts[1] = vocts[master_voice];
-                    vocts[master_voice] = inputs[VOCT_INPUT].getVoltage();
-                    break;
-                }
-                case FWDFWD: {
-                    master_voice = (master_voice + 1) % 4;
-                    vocts[master_voice] = inputs[VOCT_INPUT].getVoltage();
-                    break;
-                }
-                case FWDBWD: {
-                    if (order == RIGHT) {
-                        master_voice += 1;
-                        if (master_voice == 3) order = LEFT;
-                    } else {
-                        master_voice -= 1;
-                        if (master_voice == 0) order = RIGHT;
-                    }
-                    vocts[master_voice] = inputs[VOCT_INPUT].getVoltage();
-                    break;
-                }
-                case RND: {
-                    master_voice = (uint8_t)(random::u32() % 4);
-                    vocts[master_voice] = inputs[VOCT_INPUT].getVoltage();
-                    break;
-                }
-            }
+        // an unpatched input still drives one channel, at 0V
+        core.channels = std::max(1, inputs[VOCT_INPUT].getChannels());
+        // voice outputs past the canon depth stay at 0V
+        for (uint8_t voice = 0; voice < 4; voice++)
+            outputs[VOICE1_OUTPUT + voice].setChannels(voice < core.voices ? core.channels : 0);
+        // every voice of every channel, for as many as fit in one cable
+        outputs[POLY_OUTPUT].setChannels(std::min(16, core.channels * core.voices));
+
+        // only patched voices take part in pitch assignment, and only blocks
+        // of 4 voices with a patched one in them are computed; the poly
+        // output needs all of them
+        uint16_t patched = outputs[POLY_OUTPUT].isConnected() ? 0xffff : 0;
+        for (uint8_t voice = 0; voice < 4; voice++)
+            if (outputs[VOICE1_OUTPUT + voice].isConnected()) patched |= 1 << voice;
+        core.setActive(patched);
+        // 10V of CV takes the spread from none to all the way, per channel
+        if (core.unison > 1) {
+            for (int c = 0; c < core.channels; c++)
+                core.setSpread(c, clamp(spread + inputs[SPREAD_INPUT].getPolyVoltage(c) / 10.f, 0.f, 1.f) / 12.f);
         }
+        // dimmed for the active voices, full for the one the newest pitch went to
+        int newest = core.newestVoice(0);
+        for (uint8_t voice = 0; voice < 4; voice++)
+            lights[VOICE1_LIGHT + voice].setBrightness(voice == newest ? 1.f : core.any_active && ((core.active >> voice) & 1) ? 0.3f : 0.f);
+
+        pitch_ramp.setTarget(current_pitch());
+    }
+
+    void process(const ProcessArgs& args) override
+    {
+        bool timed = timer.start();
+
+        if (control.process()) processControls();
 
-        for (uint8_t voice = 0; voice < 4; voice++) {
-            phases[voice] += volt2freq(current_pitch() + vocts[voice]) * args.sampleTime;
-            if (phases[voice] >= 1.f)
-                phases[voice] -= 1.f;
+        core.process(pitch_ramp.process(), args.sampleTime, inputs[VOCT_INPUT].getVoltages(), voice_buffer);
+
+        for (uint8_t voice = 0; voice < 4 && voice < core.voices; voice++) {
+            if (!outputs[VOICE1_OUTPUT + voice].isConnected()) continue;
+            float* out = outputs[VOICE1_OUTPUT + voice].getVoltages();
+            for (int c = 0; c < core.channels; c++)
+                out[c] = voice_buffer[c * KanonCore::MAX_VOICES + voice];
         }
 
-        last_voct = inputs[VOCT_INPUT].getVoltage();
+        if (outputs[POLY_OUTPUT].isConnected()) {
+            float* out = outputs[POLY_OUTPUT].getVoltages();
+            int k = 0;
+            for (int c = 0; c < core.channels && k < 16; c++)
+                for (int voice = 0; voice < core.voices && k < 16; voice++)
+                    out[k++] = voice_buffer[c * KanonCore::MAX_VOICES + voice];
+        }
 
-        // maybe there's an objectively faster way to do this?
-        // this should be fast enough though
-        float (Kanon::*waveshapes[])(float) = {&Kanon::sine, &Kanon::triangle, &Kanon::square, &Kanon::saw};
+        if (timed) timer.stop();
+        if (++frames >= TELEMETRY_WINDOW) publishTelemetry();
+    }
 
-        outputs[VOICE1_OUTPUT].setVoltage(5.f * (this->*waveshapes[waveshape])(phases[0]));
-        outputs[VOICE2_OUTPUT].setVoltage(5.f * (this->*waveshapes[waveshape])(phases[1]));
-        outputs[VOICE3_OUTPUT].setVoltage(5.f * (this->*waveshapes[waveshape])(phases[2]));
-        outputs[VOICE4_OUTPUT].setVoltage(5.f * (this->*waveshapes[waveshape])(phases[3]));
+    // the window, and the voice assignments as they stand, for the UI thread
+    void publishTelemetry()
+    {
+        KanonTelemetry& t = telemetry.write();
+        t.window = window++;
+        timer.summarize(t.time);
+        t.channels = core.channels;
+        t.voices = core.voices;
+        t.active = core.any_active ? core.active : 0;
+        for (int c = 0; c < core.channels; c++) {
+            t.newest[c] = core.newestVoice(c);
+            for (int v = 0; v < core.voices; v++) t.pitch[c][v] = core.voicePitch(c, v);
+        }
+        telemetry.publish();
+        frames = 0;
     }
 
     json_t *dataToJson() override
     {
         json_t *rootJ = json_object();
 
-        json_object_set_new(rootJ, "mode", json_integer(mode));
-        json_object_set_new(rootJ, "waveshape", json_integer(waveshape));
+        json_object_set_new(rootJ, "mode", json_integer(core.mode));
+        json_object_set_new(rootJ, "waveshape", json_integer(core.waveshape));
+        json_object_set_new(rootJ, "oscillator", json_integer(requested_oscillator.load()));
+        json_object_set_new(rootJ, "voices", json_integer(requested_voices.load()));
+        json_object_set_new(rootJ, "unison", json_integer(requested_unison.load()));
+        json_object_set_new(rootJ, "spread", json_real(spread));
         json_object_set_new(rootJ, "coarse", json_real(params[COARSE_PARAM].getValue()));
         json_object_set_new(rootJ, "fine", json_real(params[FINE_PARAM].getValue()));
 
@@ -277,6 +285,15 @@ struct Kanon : Module {
     {
         setMode(json_integer_value(json_object_get(rootJ, "mode")));
         setWaveshape(json_integer_value(json_object_get(rootJ, "waveshape")));
+        // missing in patches from before the wavetable oscillator, i.e. polyBLEP
+        setOscillator(json_integer_value(json_object_get(rootJ, "oscillator")));
+        // missing in patches from before the canon depth setting, i.e. 4
+        json_t* voicesJ = json_object_get(rootJ, "voices");
+        setVoices(voicesJ ? json_integer_value(voicesJ) : 4);
+        // both missing in patches from before unison, i.e. none
+        json_t* spreadJ = json_object_get(rootJ, "spread");
+        setUnison(json_integer_value(json_object_get(rootJ, "unison")));
+        spread = spreadJ ? clamp((float) json_number_value(spreadJ), 0.f, 1.f) : DEFAULT_SPREAD;
         params[COARSE_PARAM].setValue(json_real_value(json_object_get(rootJ, "coarse")));
         params[FINE_PARAM].setValue(json_real_value(json_object_get(rootJ, "fine")));
     }
@@ -286,24 +303,30 @@ struct Kanon : Module {
         setMode(random::u32() % 4);
         setWaveshape(random::u32() % 4);
         // vvvvvvvvvvvvvv
-        order = RIGHT;
-        master_voice = 0;
+        for (int c = 0; c < 16; c++) {
+            core.groups[c].order = KanonCore::RIGHT;
+            core.groups[c].master_voice = 0;
+        }
         // ^^^^^^^^^^^^^^ not sure if reduntant or not
     }
 
     void onReset() override
     {
-        setMode(KANON);
-        setWaveshape(SINE);
+        setMode(KanonCore::KANON);
+        setWaveshape(KanonCore::SINE);
+        setOscillator(KanonCore::POLYBLEP);
+        setVoices(4);
+        setUnison(1);
+        spread = DEFAULT_SPREAD;
         params[COARSE_PARAM].setValue(0.f);
         params[FINE_PARAM].setValue(0.f);
 
-        order = RIGHT;
-        master_voice = 0;
-        last_voct = 0.f;
+        core.reset();
     }
 };
 
+constexpr float Kanon::DEFAULT_SPREAD;
+
 
 struct KanonWidget : ModuleWidget {
     KanonWidget(Kanon* module) {
@@ -341,11 +364,97 @@ struct KanonWidget : ModuleWidget {
         addParam(createParamCentered<MF_MiniButton>(mm2px(Vec(44.45, 60.65)), module, Kanon::MODE_RND_PARAM));
 
         addInput(createInputCentered<PJ301MPort>(mm2px(Vec(11.91, 108.31)), module, Kanon::VOCT_INPUT));
+        addInput(createInputCentered<PJ301MPort>(mm2px(Vec(11.91, 51.5)), module, Kanon::SPREAD_INPUT));
 
         addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(29.27, 93.95)), module, Kanon::VOICE1_OUTPUT));
         addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(41.62, 93.95)), module, Kanon::VOICE2_OUTPUT));
         addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(29.27, 108.31)), module, Kanon::VOICE3_OUTPUT));
         addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(41.62, 108.31)), module, Kanon::VOICE4_OUTPUT));
+        addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(11.91, 90.0)), module, Kanon::POLY_OUTPUT));
+        // active voice lights
+        addChild(createLightCentered<TinyLight<WhiteLight>>(mm2px(Vec(34.07, 89.15)), module, Kanon::VOICE1_LIGHT));
+        addChild(createLightCentered<TinyLight<WhiteLight>>(mm2px(Vec(46.42, 89.15)), module, Kanon::VOICE2_LIGHT));
+        addChild(createLightCentered<TinyLight<WhiteLight>>(mm2px(Vec(34.07, 103.51)), module, Kanon::VOICE3_LIGHT));
+        addChild(createLightCentered<TinyLight<WhiteLight>>(mm2px(Vec(46.42, 103.51)), module, Kanon::VOICE4_LIGHT));
+    }
+
+    // while recording, one CSV line per telemetry window
+    TelemetryLog log;
+
+    void step() override
+    {
+        ModuleWidget::step();
+        Kanon* module = getModule<Kanon>();
+        if (!module || !module->telemetry.update() || !log.file) return;
+
+        const KanonTelemetry& t = module->telemetry.latest();
+        std::fprintf(log.file, "%u,%.0f,%.0f,%.0f,%d,%d,%d", t.window, t.time.min, t.time.avg, t.time.p99, t.channels, t.voices, t.active);
+        for (int c = 0; c < 16; c++) {
+            std::fprintf(log.file, ",%d", c < t.channels ? t.newest[c] : -1);
+            for (int v = 0; v < KanonCore::MAX_VOICES; v++)
+                std::fprintf(log.file, ",%.4f", c < t.channels && v < t.voices ? t.pitch[c][v] : 0.f);
+        }
+        std::fprintf(log.file, "\n");
+    }
+
+    void startLog()
+    {
+        std::string header = "window,min_ns,avg_ns,p99_ns,channels,voices,active_mask";
+        for (int c = 1; c <= 16; c++) {
+            header += string::f(",ch%d_newest_voice", c);
+            for (int v = 1; v <= KanonCore::MAX_VOICES; v++) header += string::f(",ch%d_voice%d_voct", c, v);
+        }
+        std::string dir = asset::user("minimal-friction");
+        system::createDirectories(dir);
+        log.start(system::join(dir, string::f("kanon-%lld.csv", (long long) module->id)), header.c_str());
+    }
+
+    void appendContextMenu(Menu* menu) override
+    {
+        Kanon* module = getModule<Kanon>();
+
+        menu->addChild(new MenuSeparator);
+        menu->addChild(createIndexSubmenuItem("Oscillator", {"Band-limited (polyBLEP)", "Wavetable"},
+            [=]() { return module->requested_oscillator.load(); },
+            [=](size_t o) { module->setOscillator(o); }
+        ));
+
+        std::vector<std::string> depths;
+        for (int n = 1; n <= KanonCore::MAX_VOICES; n++) depths.push_back(string::f("%d", n));
+        menu->addChild(createIndexSubmenuItem("Voices", depths,
+            [=]() { return module->requested_voices.load() - 1; },
+            [=](size_t n) { module->setVoices(n + 1); }
+        ));
+
+        std::vector<std::string> stacks;
+        for (int n = 1; n <= KanonCore::MAX_UNISON; n++) stacks.push_back(string::f("%d", n));
+        menu->addChild(createSubmenuItem("Unison", string::f("%d", module->requested_unison.load()), [=](Menu* menu) {
+            menu->addChild(createIndexSubmenuItem("Oscillators per voice", stacks,
+                [=]() { return module->requested_unison.load() - 1; },
+                [=](size_t n) { module->setUnison(n + 1); }
+            ));
+            // of the outermost ones, either way
+            menu->addChild(new MF_MenuSlider("Spread", &module->spread, Kanon::DEFAULT_SPREAD, " cents"));
+        }));
+
+        menu->addChild(createSubmenuItem("Telemetry", "", [=](Menu* menu) {
+            const KanonTelemetry& t = module->telemetry.latest();
+            menu->addChild(createMenuLabel(string::f("process(): %.0f / %.0f / %.0f ns (min / avg / p99)", t.time.min, t.time.avg, t.time.p99)));
+            for (int c = 0; c < t.channels; c++) {
+                // pitches in semitones, the newest one's marked
+                std::string pitches;
+                for (int v = 0; v < t.voices; v++) {
+                    if (!(t.active & (1 << v))) continue;
+                    pitches += string::f(v == t.newest[c] ? " [%+.1f]" : " %+.1f", t.pitch[c][v] * 12.f);
+                }
+                menu->addChild(createMenuLabel(string::f("Channel %d:%s", c+1, pitches.empty() ? " no active voices" : pitches.c_str())));
+            }
+            menu->addChild(createBoolMenuItem("Record to file", "",
+                [=]() { return log.file != nullptr; },
+                [=](bool r) { if (r) startLog(); else log.stop(); }
+            ));
+            if (log.file) menu->addChild(createMenuLabel(log.path));
+        }));
     }
 };
 
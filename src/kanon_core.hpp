@@ -0,0 +1,533 @@
+#pragma once
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include <simd/Vector.hpp>
+#include <simd/functions.hpp>
+#include <dsp/common.hpp>
+#include "approx.hpp"
+#include "wavetable.hpp"
+
+using namespace rack;
+
+
+// Kanon's oscillator bank and pitch assignment, without any rack::Module
+// state, so that it can be driven (and profiled) outside of Rack.
+// The Kanon module only adds params, buttons, lights and ports on top.
+struct KanonCore {
+    enum Waveshape {
+        SINE,
+        TRIANGLE,
+        SQUARE,
+        SAW
+    };
+
+    enum Mode {
+        KANON,
+        FWDFWD,
+        FWDBWD,
+        RND
+    };
+
+    enum Oscillator {
+        POLYBLEP,
+        WAVETABLE
+    };
+
+    // Used only in forward-backward mode
+    enum Order {
+        RIGHT,
+        LEFT
+    };
+
+    // At most 16 voices per channel, in blocks of 4 lanes, so that
+    // 4 voices at a time are advanced and waveshaped in a single vector pass.
+    static const int MAX_VOICES = 16;
+    static const int BLOCKS = MAX_VOICES / 4;
+    // Each voice is a stack of up to this many detuned sub-oscillators, one
+    // more vector pass per block each.
+    static const int MAX_UNISON = 8;
+
+    // The voices driven by one channel of the 1V/oct input.
+    // Phases are 32-bit fixed point, 2^32 being one cycle,
+    // so they wrap on their own and never drift.
+    struct VoiceGroup {
+        // per unison sub-oscillator, 0 being the only one without unison
+        simd::int32_4 phases[MAX_UNISON][BLOCKS];
+        // each sub-oscillator's frequency relative to its voice's, and the
+        // spread, in volts, they were last worked out for
+        float detune[MAX_UNISON];
+        float spread = 0.f;
+        // pitch of each voice, in every mode but KANON
+        simd::float_4 vocts[BLOCKS];
+        // KANON mode pitch history, newest first from head. Every entry is
+        // stored twice, MAX_VOICES apart, so the most recent MAX_VOICES
+        // pitches are always contiguous and a new one is pushed in O(1)
+        // by moving head back, instead of shifting every voice along.
+        float history[2 * MAX_VOICES];
+        uint8_t head = 0;
+        uint8_t master_voice = 0;
+        uint8_t order = RIGHT;
+        float last_voct = 0.f;
+
+        VoiceGroup()
+        {
+            for (int b = 0; b < BLOCKS; b++) {
+                // sub-oscillators start out a golden ratio of a cycle apart,
+                // evenly spread however many of them are in use
+                for (int k = 0; k < MAX_UNISON; k++) phases[k][b] = (int32_t) (k * 2654435769u);
+                vocts[b] = 0.f;
+            }
+            std::fill(detune, detune + MAX_UNISON, 1.f);
+            std::fill(history, history + 2 * MAX_VOICES, 0.f);
+        }
+
+        inline float& voct(int v)
+        {
+            return vocts[v / 4][v % 4];
+        }
+
+        inline void push(float v)
+        {
+            head = (head - 1) & (MAX_VOICES - 1);
+            history[head] = history[head + MAX_VOICES] = v;
+        }
+
+        void reset()
+        {
+            master_voice = 0;
+            order = RIGHT;
+            last_voct = 0.f;
+        }
+    };
+    // Each channel of a polyphonic 1V/oct cable gets its own group.
+    VoiceGroup groups[16];
+    int channels = 1;
+    // canon depth, i.e. voices per channel
+    int voices = 4;
+    // sub-oscillators per voice, and what their sum is scaled by
+    int unison = 1;
+    float unison_gain = 1.f;
+
+    uint8_t waveshape = SINE;
+    uint8_t mode = KANON;
+    uint8_t oscillator = POLYBLEP;
+    // Bit N set if voice N takes part in pitch assignment. Never 0, see
+    // setActive(). Voices are computed 4 at a time, see processKernel().
+    uint16_t active = 0xf;
+    uint8_t active_count = 4;
+    // the mask last given to setActive(), before limiting it to voices
+    uint16_t patched = 0xf;
+    // false if no voice is patched at all, in which case nothing is computed
+    bool any_active = true;
+    // true if every voice is active, so KANON mode voices can load
+    // their pitches straight from the history; otherwise the active ones'
+    // are copied to vocts whenever they change, see gatherVocts()
+    bool active_full = true;
+    // rank[v] is the number of active voices before voice v, i.e. how
+    // far back in the KANON mode history voice v plays
+    uint8_t rank[MAX_VOICES];
+    // shared tables, only built once some Kanon switches to them
+    const Wavetable* wavetable = nullptr;
+
+    // xorshift32 state for random mode
+    uint32_t rng_state = 0x9e3779b9;
+
+    KanonCore()
+    {
+        setActive(patched);
+        selectKernel();
+    }
+
+    // The setters below are for the thread that calls process(), between
+    // calls, as they swap kernels and rewrite state the kernels read.
+    void setWaveshape(uint8_t w)
+    {
+        waveshape = w;
+        selectKernel();
+    }
+    void setOscillator(uint8_t o)
+    {
+        // build (or fetch) the tables before any kernel can use them
+        if (o == WAVETABLE) wavetable = &Wavetable::get();
+        oscillator = o;
+        selectKernel();
+    }
+    void setMode(uint8_t m)
+    {
+        // hand the voices' current pitches over between the
+        // KANON mode history and the per-voice pitches
+        if (m == KANON && mode != KANON) {
+            for (int c = 0; c < 16; c++) {
+                VoiceGroup& g = groups[c];
+                g.head = 0;
+                for (int v = 0; v < voices; v++)
+                    if (active & (1 << v))
+                        g.history[rank[v]] = g.history[rank[v] + MAX_VOICES] = g.voct(v);
+                if (!active_full) gatherVocts(g);
+            }
+        }
+        else if (m != KANON && mode == KANON) {
+            for (int c = 0; c < 16; c++) {
+                VoiceGroup& g = groups[c];
+                for (int v = 0; v < MAX_VOICES; v++) g.voct(v) = g.history[g.head + rank[v]];
+                g.master_voice = activeFrom(-1, 1);
+            }
+        }
+        mode = m;
+        selectKernel();
+    }
+    void setVoices(int n)
+    {
+        voices = std::min(std::max(n, 1), (int) MAX_VOICES);
+        setActive(patched);
+    }
+    // Detuned sub-oscillators add up in power rather than in amplitude, so
+    // 1 / sqrt(n) keeps the stack as loud as a single one. Every so often
+    // they all line up though, so beyond 4 of them it's 2 / n instead,
+    // which keeps those peaks within 10V.
+    void setUnison(int n)
+    {
+        unison = std::min(std::max(n, 1), (int) MAX_UNISON);
+        unison_gain = std::min(1.f / std::sqrt((float) unison), 2.f / unison);
+        for (int c = 0; c < 16; c++) detuneGroup(groups[c]);
+    }
+    // Control rate. The sub-oscillators of channel c's voices are detuned
+    // evenly from -volts to +volts.
+    void setSpread(int c, float volts)
+    {
+        if (volts == groups[c].spread) return;
+        groups[c].spread = volts;
+        detuneGroup(groups[c]);
+    }
+    void detuneGroup(VoiceGroup& g)
+    {
+        std::fill(g.detune, g.detune + MAX_UNISON, 1.f);
+        if (unison < 2) return;
+        for (int k = 0; k < unison; k++) g.detune[k] = std::exp2(g.spread * (2.f * k / (unison - 1) - 1.f));
+    }
+    // Voices whose outputs aren't patched are skipped by the pitch
+    // assignment, and don't need computing. With nothing patched, all
+    // voices keep taking part so the assignment state stays meaningful.
+    void setActive(uint16_t mask)
+    {
+        uint16_t was_active = active;
+        bool was_full = active_full;
+        patched = mask;
+        uint16_t all = (1 << voices) - 1;
+        mask &= all;
+        any_active = mask != 0;
+        active = mask ? mask : all;
+        active_full = active == all;
+        active_count = 0;
+        for (int v = 0; v < MAX_VOICES; v++) {
+            bool a = v < voices && (active & (1 << v));
+            rank[v] = a ? active_count : 0;
+            if (a) active_count++;
+        }
+        // an active voice's rank only depends on which voices are active
+        if (mode == KANON && !active_full && (active != was_active || was_full))
+            for (int c = 0; c < 16; c++) gatherVocts(groups[c]);
+        // a master voice beyond a lowered canon depth, or unpatched, would
+        // have nowhere to move on from
+        for (int c = 0; c < 16; c++) {
+            VoiceGroup& g = groups[c];
+            if (g.master_voice >= voices || !(active & (1 << g.master_voice))) g.master_voice = activeFrom(-1, 1);
+        }
+    }
+    // KANON mode, with only some voices active: the voices' pitches from
+    // the history, so that the kernels can load them in one go rather than
+    // pick them out every sample.
+    void gatherVocts(VoiceGroup& g)
+    {
+        for (int v = 0; v < MAX_VOICES; v++) g.voct(v) = g.history[g.head + rank[v]];
+    }
+
+    void seed(uint32_t s)
+    {
+        // xorshift gets stuck on 0
+        rng_state = s ? s : 0x9e3779b9;
+    }
+
+    void reset()
+    {
+        for (int c = 0; c < 16; c++) groups[c].reset();
+    }
+
+    inline uint32_t rng()
+    {
+        rng_state ^= rng_state << 13;
+        rng_state ^= rng_state >> 17;
+        rng_state ^= rng_state << 5;
+        return rng_state;
+    }
+
+    /*==- WAVESHAPE FUNCTIONS -==*/
+    // Might look into more efficient ways to evaluate
+    // in the future (e.g. recursive oscillators, alike
+    // Bogaudio although for some reason they sound weird!).
+    // Each lane of the vector is one voice. dt is the phase increment
+    // per sample, used to band-limit the discontinuities: square and saw
+    // get a polyBLEP residual at their jumps, triangle a polyBLAMP one
+    // at its corners, which is clean enough without oversampling.
+    inline simd::float_4 sine(simd::float_4 phase, simd::float_4 dt)
+    {
+        return approx::sin2pi(phase);
+    }
+
+    inline simd::float_4 triangle(simd::float_4 phase, simd::float_4 dt)
+    {
+        simd::float_4 naive = 2.f * simd::abs(2.f*(phase - simd::floor(phase + 0.5f))) - 1.f;
+        // slope changes by +-8 at phase 0 and 0.5
+        return naive + 8.f * dt * (polyblamp(phase, dt) - polyblamp(wrap(phase + 0.5f), dt));
+    }
+
+    inline simd::float_4 square(simd::float_4 phase, simd::float_4 dt)
+    {
+        simd::float_4 naive = simd::ifelse(phase > 0.5f, 1.f, -1.f);
+        // falls at phase 0, rises at phase 0.5
+        return naive - polyblep(phase, dt) + polyblep(wrap(phase + 0.5f), dt);
+    }
+
+    inline simd::float_4 saw(simd::float_4 phase, simd::float_4 dt)
+    {
+        return 2.f*phase - 1.f - polyblep(phase, dt);
+    }
+    /*==- ------------------- -==*/
+
+    // 32-bit fixed point phase to [0, 1)
+    static inline simd::float_4 phase2float(simd::int32_4 phase)
+    {
+        return simd::float_4((phase >> 8) & simd::int32_4(0xffffff)) * (1.f / 16777216.f);
+    }
+
+    // phase increment to 32-bit fixed point; above Nyquist it doesn't
+    // matter anymore, and capping it keeps the conversion in int32 range
+    static inline simd::int32_4 float2phase(simd::float_4 dt)
+    {
+        return simd::int32_4(simd::fmin(dt, 0.5f) * 2147483648.f) << 1;
+    }
+
+    /*==- BAND-LIMITING RESIDUALS -==*/
+    // Two-sample polynomial approximations of the band-limited step (BLEP)
+    // and ramp (BLAMP) residuals, for a discontinuity at phase 0.
+    // Voices away from a discontinuity are masked to zero.
+    static inline simd::float_4 wrap(simd::float_4 phase)
+    {
+        return phase - simd::floor(phase);
+    }
+
+    static inline simd::float_4 polyblep(simd::float_4 t, simd::float_4 dt)
+    {
+        dt = simd::fmin(dt, 0.5f);
+        simd::float_4 a = t / dt;
+        simd::float_4 b = (t - 1.f) / dt;
+        return simd::ifelse(t < dt, a + a - a*a - 1.f,
+               simd::ifelse(t > 1.f - dt, b*b + b + b + 1.f, 0.f));
+    }
+
+    static inline simd::float_4 polyblamp(simd::float_4 t, simd::float_4 dt)
+    {
+        dt = simd::fmin(dt, 0.5f);
+        simd::float_4 a = t / dt - 1.f;
+        simd::float_4 b = (t - 1.f) / dt + 1.f;
+        return simd::ifelse(t < dt, -1.f/3.f * a*a*a,
+               simd::ifelse(t > 1.f - dt, 1.f/3.f * b*b*b, 0.f));
+    }
+    /*==- ----------------------- -==*/
+
+    inline simd::float_4 volt2freq(simd::float_4 v)
+    {
+        return dsp::FREQ_C4 * approx::exp2(v);
+    }
+
+    /*
+    ... if the voltage of master pitch is the same as last frame:
+
+    KANON MODE:
+        push the current input pitch onto the history
+        (voice N plays the pitch N - 1 changes ago)
+
+    FWD-FWD MODE: (assume <master> voice)
+        set master voice to current input pitch
+        master voice = (master voice + 1) % <voices>
+
+    FWD-BWD MODE: (assume <master> voice)
+        set master voice to current input pitch
+        if order=left:
+            master voice -= 1
+            if master voice = 0: order=right
+        else:
+            master voice += 1
+            if master voice = <voices> - 1: order=left
+
+    All of the above only counts the voices in the active mask, i.e. the ones
+    whose outputs are patched: "voice N + 1" means the next patched voice, the
+    turnaround points of FWD-BWD are the outermost patched voices and so on.
+    */
+    // First active voice strictly after v in the given direction, or -1.
+    inline int activeFrom(int v, int step) const
+    {
+        for (v += step; v >= 0 && v < voices; v += step)
+            if (active & (1 << v)) return v;
+        return -1;
+    }
+
+    // The voice channel c's newest pitch went to, or -1 if none is active.
+    int newestVoice(int c) const
+    {
+        if (!any_active) return -1;
+        return mode == KANON ? activeFrom(-1, 1) : groups[c].master_voice;
+    }
+
+    // The pitch voice v of channel c plays, before coarse and fine.
+    float voicePitch(int c, int v) const
+    {
+        const VoiceGroup& g = groups[c];
+        return mode == KANON ? g.history[g.head + rank[v]] : g.vocts[v / 4][v % 4];
+    }
+
+    template <uint8_t M>
+    inline void assignPitch(VoiceGroup& g, float voct)
+    {
+        // M is a template argument, so the switch folds away at compile time
+        switch (M)
+        {
+            case KANON: {
+                // the k-th active voice reads the k-th newest pitch,
+                // so every one of them moves along at once
+                g.push(voct);
+                if (!active_full) gatherVocts(g);
+                break;
+            }
+            case FWDFWD: {
+                int v = activeFrom(g.master_voice, 1);
+                g.master_voice = v >= 0 ? v : activeFrom(-1, 1);
+                g.voct(g.master_voice) = voct;
+                break;
+            }
+            case FWDBWD: {
+                int step = g.order == RIGHT ? 1 : -1;
+                int v = activeFrom(g.master_voice, step);
+                if (v < 0) {
+                    // the voices past master in this direction got unpatched
+                    step = -step;
+                    v = activeFrom(g.master_voice, step);
+                    // master is the only active voice
+                    if (v < 0) v = activeFrom(-1, 1);
+                }
+                g.master_voice = v;
+                // turn around at the outermost active voice
+                if (activeFrom(v, step) < 0) g.order = step > 0 ? LEFT : RIGHT;
+                else g.order = step > 0 ? RIGHT : LEFT;
+                g.voct(g.master_voice) = voct;
+                break;
+            }
+            case RND: {
+                // k-th active voice, k picked at random
+                int k = rng() % active_count;
+                int v = activeFrom(-1, 1);
+                while (k--) v = activeFrom(v, 1);
+                g.master_voice = v;
+                g.voct(g.master_voice) = voct;
+                break;
+            }
+        }
+    }
+
+    template <uint8_t W>
+    inline simd::float_4 shape(simd::float_4 phase, simd::float_4 dt)
+    {
+        switch (W)
+        {
+            case SINE:     return sine(phase, dt);
+            case TRIANGLE: return triangle(phase, dt);
+            case SQUARE:   return square(phase, dt);
+            default:       return saw(phase, dt);
+        }
+    }
+
+    // Pitch of the voice the input last went to.
+    template <uint8_t M>
+    inline float masterVoct(VoiceGroup& g)
+    {
+        return M == KANON ? g.history[g.head] : g.voct(g.master_voice);
+    }
+
+    // Pitches of voices 4b to 4b+3.
+    template <uint8_t M>
+    inline simd::float_4 blockVocts(VoiceGroup& g, int b)
+    {
+        if (M == KANON && active_full) return simd::float_4::load(&g.history[g.head + 4 * b]);
+        return g.vocts[b];
+    }
+
+    /*==- PROCESS KERNELS -==*/
+    // One kernel per oscillator x waveshape x mode combination, so that the
+    // per-sample path has no indirect calls or switches and each waveshape
+    // can be inlined. The active one is picked by selectKernel() whenever
+    // the state changes.
+    //
+    // vocts holds one 1V/oct voltage per channel, pitch is the coarse + fine
+    // offset in volts, and voice v of channel c is written to
+    // out[c * MAX_VOICES + v].
+    template <uint8_t O, uint8_t W, uint8_t M>
+    void processKernel(float pitch, float sampleTime, const float* vocts, float* out)
+    {
+        if (!any_active) return;
+        int blocks = (voices + 3) / 4;
+
+        for (int c = 0; c < channels; c++) {
+            VoiceGroup& g = groups[c];
+            float voct = vocts[c];
+
+            // process pitch change
+            if (voct == g.last_voct && voct != masterVoct<M>(g))
+                assignPitch<M>(g, voct);
+            g.last_voct = voct;
+
+            for (int b = 0; b < blocks; b++) {
+                // The 4 voices of a block share one vector pass, so it's
+                // skipped only if none of them is needed: an unpatched voice
+                // next to a patched one costs as much as if it were patched,
+                // bar the wavetable lookup, which goes voice by voice.
+                uint8_t mask = (active >> (4 * b)) & 0xf;
+                if (!mask) continue;
+
+                simd::float_4 dt = volt2freq(pitch + blockVocts<M>(g, b)) * sampleTime;
+
+                // the unison sub-oscillators of all 4 voices, a vector pass each
+                simd::float_4 o = 0.f;
+                for (int k = 0; k < unison; k++) {
+                    simd::float_4 dtk = dt * g.detune[k];
+                    g.phases[k][b] += float2phase(dtk);
+                    o += O == WAVETABLE
+                        ? wavetable->lookup(W, g.phases[k][b], dtk, mask)
+                        : shape<W>(phase2float(g.phases[k][b]), dtk);
+                }
+                o *= 5.f * unison_gain;
+                o.store(&out[c * MAX_VOICES + 4 * b]);
+            }
+        }
+    }
+
+    typedef void (KanonCore::*Kernel)(float, float, const float*, float*);
+    Kernel kernel;
+
+    void selectKernel()
+    {
+    #define KERNEL_ROW(O, W) { &KanonCore::processKernel<O, W, KANON>, &KanonCore::processKernel<O, W, FWDFWD>, \
+                               &KanonCore::processKernel<O, W, FWDBWD>, &KanonCore::processKernel<O, W, RND> }
+    #define KERNEL_TABLE(O) { KERNEL_ROW(O, SINE), KERNEL_ROW(O, TRIANGLE), KERNEL_ROW(O, SQUARE), KERNEL_ROW(O, SAW) }
+        static const Kernel kernels[2][4][4] = { KERNEL_TABLE(POLYBLEP), KERNEL_TABLE(WAVETABLE) };
+    #undef KERNEL_TABLE
+    #undef KERNEL_ROW
+        kernel = kernels[oscillator % 2][waveshape % 4][mode % 4];
+    }
+    /*==- --------------- -==*/
+
+    inline void process(float pitch, float sampleTime, const float* vocts, float* out)
+    {
+        (this->*kernel)(pitch, sampleTime, vocts, out);
+    }
+};
@@ -0,0 +1,203 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+// Per-module instrumentation. The audio thread gathers whatever a module
+// wants to show about itself over a window of TELEMETRY_WINDOW frames, then
+// publishes it in one go through a Snapshot, which the UI thread picks up
+// for lights, menus and logging. Nothing here takes a lock or allocates on
+// the audio thread.
+
+// frames per telemetry window, about a tenth of a second at 44.1 or 48 kHz
+#define TELEMETRY_WINDOW 4096
+
+
+// The most recent T from a single writer thread, for a single reader
+// thread: a triple buffer. The writer fills in a slot of its own and swaps
+// it with the middle one; the reader swaps its own with the middle one
+// whenever that holds something new. Neither ever waits for the other,
+// and the reader only ever skips snapshots, never sees one half-written.
+template <typename T>
+struct Snapshot {
+    // Writer: fill this in, then publish() it.
+    T& write()
+    {
+        return slots[back];
+    }
+
+    void publish()
+    {
+        back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & SLOT;
+    }
+
+    // Reader: takes the latest snapshot, if there's one it hasn't taken yet.
+    bool update()
+    {
+        if (!(middle.load(std::memory_order_acquire) & FRESH)) return false;
+        front = middle.exchange(front, std::memory_order_acq_rel) & SLOT;
+        return true;
+    }
+
+    // Reader: the snapshot last taken by update().
+    const T& latest() const
+    {
+        return slots[front];
+    }
+
+private:
+    enum { SLOT = 3, FRESH = 4 };
+    T slots[3] = {};
+    uint8_t back = 0;
+    std::atomic<uint8_t> middle{1};
+    uint8_t front = 2;
+};
+
+
+// what process() cost over a window, in nanoseconds
+struct ProcessTime {
+    float min = 0.f;
+    float avg = 0.f;
+    float p99 = 0.f;
+};
+
+// Times process() calls, into a histogram with 8 bins per octave of
+// nanoseconds, which min, average and 99th percentile (to within a bin)
+// are read off of at the end of each window. Only one call in every STRIDE
+// is timed, so that reading the clock doesn't become the cost being
+// measured; STRIDE is odd, so every offset from a control tick is sampled
+// alike.
+struct ProcessTimer {
+    enum { STRIDE = 7, BINS = 8 * 32 };
+
+    // Call at the start of process(), and stop() at the end if it returned true.
+    inline bool start()
+    {
+        if (--countdown > 0) return false;
+        countdown = STRIDE;
+        started = now();
+        return true;
+    }
+
+    inline void stop()
+    {
+        int64_t ns = std::max((int64_t) 1, now() - started);
+        bins[bin(ns)]++;
+        count++;
+        sum += ns;
+        shortest = std::min(shortest, ns);
+    }
+
+    // the window's figures, and starts a new one
+    void summarize(ProcessTime& out)
+    {
+        out = ProcessTime();
+        if (count) {
+            out.min = shortest;
+            out.avg = (float) sum / count;
+            // the upper edge of the bin the 99th percentile falls into
+            uint32_t rank = count - count / 100, seen = 0;
+            for (int b = 0; b < BINS; b++) {
+                seen += bins[b];
+                if (seen >= rank) {
+                    out.p99 = std::ldexp((9 + b % 8) / 8.f, b / 8);
+                    break;
+                }
+            }
+        }
+        std::fill(bins, bins + BINS, 0);
+        count = 0;
+        sum = 0;
+        shortest = INT64_MAX;
+    }
+
+private:
+    int countdown = 1;
+    int64_t started = 0;
+    uint32_t bins[BINS] = {};
+    uint32_t count = 0;
+    int64_t sum = 0;
+    int64_t shortest = INT64_MAX;
+
+    static inline int64_t now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // octave from the top bit, eighth of it from the 3 bits below
+    static inline int bin(int64_t ns)
+    {
+        int octave = 63 - __builtin_clzll((uint64_t) ns);
+        int eighth = octave >= 3 ? (ns >> (octave - 3)) & 7 : (ns << (3 - octave)) & 7;
+        return std::min(octave * 8 + eighth, (int) BINS - 1);
+    }
+};
+
+
+// Appends one line per snapshot to a CSV file, for offline analysis. UI
+// thread only.
+struct TelemetryLog {
+    FILE* file = nullptr;
+    std::string path;
+
+    bool start(const std::string& p, const char* header)
+    {
+        stop();
+        file = std::fopen(p.c_str(), "w");
+        if (!file) return false;
+        path = p;
+        std::fprintf(file, "%s\n", header);
+        return true;
+    }
+
+    void stop()
+    {
+        if (file) std::fclose(file);
+        file = nullptr;
+    }
+
+    ~TelemetryLog()
+    {
+        stop();
+    }
+};
+
+
+// Peak and energy per lane of a stereo signal, over a window.
+template <int LANES>
+struct LaneMeter {
+    float peak[LANES] = {};
+    float energy[LANES] = {};
+    int frames = 0;
+
+    inline void process(const float* left, const float* right, int lanes)
+    {
+        for (int lane = 0; lane < lanes; lane++) {
+            float l = left[lane], r = right[lane];
+            peak[lane] = std::max(peak[lane], std::max(std::fabs(l), std::fabs(r)));
+            energy[lane] += l * l + r * r;
+        }
+        frames++;
+    }
+
+    // RMS of lanes from to from + n - 1 together, both sides
+    float rms(int from, int n) const
+    {
+        if (!n || !frames) return 0.f;
+        float sum = 0.f;
+        for (int lane = from; lane < from + n; lane++) sum += energy[lane];
+        return std::sqrt(sum / (2 * n * frames));
+    }
+
+    void reset()
+    {
+        std::fill(peak, peak + LANES, 0.f);
+        std::fill(energy, energy + LANES, 0.f);
+        frames = 0;
+    }
+};
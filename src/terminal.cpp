@@ -1,9 +1,10 @@
-#include <utility>
-#include <vector>
+#include <chrono>
+#include <condition_variable>
 #include "plugin.hpp"
 #include "widgets.hpp"
-
-#define DELAY_MEMORY_SIZE 3
+#include "control.hpp"
+#include "worker.hpp"
+#include "terminal.hpp"
 
 struct Terminal : Module {
     enum ParamId {
@@ -57,25 +58,83 @@ struct Terminal : Module {
         OUTPUTS_LEN
     };
     enum LightsId {
-        LIGHTS_LEN
-    };
+        LEVEL1_GREEN_LIGHT,
+        LEVEL1_RED_LIGHT,
+
+        LEVEL2_GREEN_LIGHT,
+        LEVEL2_RED_LIGHT,
 
-    struct Channel {
-        // pair for stereo signal
-        std::pair<std::vector<float>, std::vector<float>> memory;
-        size_t write;
+        LEVEL3_GREEN_LIGHT,
+        LEVEL3_RED_LIGHT,
+        LIGHTS_LEN
     };
-    Channel channels[3];
-    size_t memory_size;
 
-    dsp::BooleanTrigger kill_trigger;
+    TerminalChannel channels[3];
+    TerminalCore core;
+    // Set from the UI thread, and handed over to core by processControls(),
+    // so that the kernel never changes under a process() call.
+    std::atomic<uint8_t> requested_interpolation{TerminalCore::LINEAR};
+    std::atomic<bool> requested_dual_head{false};
+    std::atomic<uint8_t> requested_storage{STORAGE_FLOAT};
+    // how far the delay knobs reach, which follows the storage in use
+    float max_delay = DELAY_MEMORY_SIZE;
+
+    // one float per lane, as laid out in core.layout
+    float input[2][TerminalCore::LANES] = {};
+    float arrival[2][TerminalCore::LANES] = {};
+    float gain[TerminalCore::LANES] = {};
+    float delay_time[TerminalCore::LANES] = {};
+    float departure[2][TerminalCore::LANES] = {};
+
+    // from the expanders, see TerminalUpstream
+    TerminalUpstream upstream[2];
+    // expanders heard from at the last control tick
+    int expanders = 0;
+
+    // see TerminalTelemetry
+    Snapshot<TerminalTelemetry> telemetry;
+    ProcessTimer timer;
+    LaneMeter<TerminalCore::LANES> meter;
+    uint32_t window = 0;
+    // for runaway detection, per channel: the last window's RMS, and
+    // how many windows in a row it has risen for
+    float last_rms[TerminalCore::CHANNELS] = {};
+    uint8_t rising[TerminalCore::CHANNELS] = {};
+    bool runaway[TerminalCore::CHANNELS] = {};
+
+    // Delay memory kept with the patch, in its patch storage, see onAdd()
+    // and onSave(). The worker thread reads the file in, and writes it out
+    // every MEMORY_AUTOSAVE_TIME, so that autosaves hold the memory too, and
+    // whenever a save asks for it; the audio thread only ever copies memory.
+    std::atomic<bool> save_memory{false};
+    std::mutex file_mutex;
+    // notified by the worker thread whenever it's done with a write
+    std::condition_variable saved;
+    // guarded by file_mutex: the file to read in, and the patch storage
+    // directory, empty while the module isn't in the patch
+    std::string load_path;
+    std::string storage_dir;
+    // writes asked for so far, and the last one done with, written or not
+    uint64_t save_requests = 0;
+    uint64_t saves_done = 0;
+    // set by the audio thread every MEMORY_AUTOSAVE_TIME
+    std::atomic<bool> autosave_due{false};
+    uint32_t autosave_frames = 0;
+    // worker thread: where the copy underway goes, and for which write
+    std::string capture_path;
+    uint64_t capture_request = 0;
+
+    ControlClock control;
+    // allocates and frees delay memory for core, and reads and writes it;
+    // declared after them, so that its job is done with before they go away
+    Worker worker;
 
     Terminal()
     {
         config(PARAMS_LEN, INPUTS_LEN, OUTPUTS_LEN, LIGHTS_LEN);
 
-        configInput(INPUT_L_INPUT, "Stereo left / mono input");
-        configInput(INPUT_R_INPUT, "Stereo right input");
+        configInput(INPUT_L_INPUT, "Stereo left / mono input (polyphonic)");
+        configInput(INPUT_R_INPUT, "Stereo right input (polyphonic)");
 
         for (uint8_t i = 0; i < 3; i++) {
             configParam(GAIN1_PARAM + i, 0.f, 1.f, 0.5f, string::f("Channel %d gain", i+1), "%", 0, 100);
@@ -91,71 +150,442 @@ struct Terminal : Module {
             configOutput(DEPARTURE1_L_OUTPUT + i*2, string::f("Channel %d stereo left feedback output", i+1));
             configOutput(DEPARTURE1_R_OUTPUT + i*2, string::f("Channel %d stereo right feedback output", i+1));
 
-            channels[i].write = 0;
-            memory_size = DELAY_MEMORY_SIZE * APP->engine->getSampleRate();
-            channels[i].memory = { std::vector<float>(memory_size, 0.f), std::vector<float>(memory_size, 0.f) };
+            configLight(LEVEL1_GREEN_LIGHT + i*2, string::f("Channel %d level (red: running away)", i+1));
+        }
+
+        rightExpander.producerMessage = &upstream[0];
+        rightExpander.consumerMessage = &upstream[1];
+
+        core.setSampleRate(APP->engine->getSampleRate());
+        worker.start([this]() {
+            transferMemory();
+            core.prepareBuffers();
+        });
+    }
+
+    // UI thread, as are setDualHead() and setStorage()
+    void setInterpolation(uint8_t i)
+    {
+        requested_interpolation.store(std::min(i, (uint8_t) TerminalCore::ALLPASS), std::memory_order_release);
+    }
+    void setDualHead(bool d)
+    {
+        requested_dual_head.store(d, std::memory_order_release);
+    }
+    void setStorage(uint8_t s)
+    {
+        requested_storage.store(s % STORAGE_LEN, std::memory_order_release);
+    }
+
+    void onSampleRateChange(const SampleRateChangeEvent& e) override
+    {
+        core.setSampleRate(e.sampleRate);
+        worker.wake();
+    }
+
+    /*==- DELAY MEMORY FILE -==*/
+
+    // in the module's patch storage directory
+    std::string memoryPath(const std::string& dir)
+    {
+        return system::join(dir, "delay-memory.bin");
+    }
+
+    // UI thread. Turning it on writes the memory out right away, rather
+    // than at the next MEMORY_AUTOSAVE_TIME.
+    void setSaveMemory(bool s)
+    {
+        save_memory.store(s);
+        if (!s) return;
+        {
+            std::lock_guard<std::mutex> lock(file_mutex);
+            if (saves_done == save_requests) save_requests++;
+        }
+        worker.wake();
+    }
+
+    // Rack sends this on every save, right before it archives the patch
+    // storage along with the patch. The file there is at most
+    // MEMORY_AUTOSAVE_TIME old; this asks for a new one, and waits
+    // SAVE_FLUSH_TIME at most for it, or for the one already underway, so
+    // that a small memory goes with the patch as it is. A large one takes
+    // longer to copy, and the patch gets the last file written before,
+    // rather than the UI stall.
+    void onSave(const SaveEvent& e) override
+    {
+        if (!save_memory) {
+            system::remove(memoryPath(getPatchStorageDirectory()));
+            return;
+        }
+        std::unique_lock<std::mutex> lock(file_mutex);
+        // one that's asked for and not done yet is as good as a new one
+        uint64_t request = saves_done < save_requests ? save_requests : ++save_requests;
+        worker.wake();
+        saved.wait_for(lock, std::chrono::duration<float>(SAVE_FLUSH_TIME), [&]() { return saves_done >= request; });
+    }
+
+    void onAdd(const AddEvent& e) override
+    {
+        std::string dir = getPatchStorageDirectory();
+        {
+            std::lock_guard<std::mutex> lock(file_mutex);
+            storage_dir = dir;
+            if (save_memory && system::exists(memoryPath(dir))) load_path = memoryPath(dir);
+        }
+        worker.wake();
+    }
+
+    // Rack cleans up the patch storage of modules that are gone, so there's
+    // nowhere to write to anymore.
+    void onRemove(const RemoveEvent& e) override
+    {
+        std::lock_guard<std::mutex> lock(file_mutex);
+        storage_dir.clear();
+    }
+
+    // Worker thread. Reads the file in, for the next buffer to start out
+    // from, or writes out the copy the audio thread has made. That goes to
+    // a file outside the patch storage first, and only then takes the
+    // place of the old one, so that a patch archived meanwhile has either
+    // one or the other, never half of it.
+    void transferMemory()
+    {
+        std::string load;
+        {
+            std::lock_guard<std::mutex> lock(file_mutex);
+            std::swap(load, load_path);
+        }
+        if (!load.empty()) {
+            FILE* f = std::fopen(load.c_str(), "rb");
+            DelayBuffer* b = f ? DelayBuffer::load(f) : nullptr;
+            if (f) std::fclose(f);
+            if (b) core.restore(b);
+            else WARN("Could not read Terminal delay memory from %s", load.c_str());
+        }
+
+        DelayBuffer* c = core.captured.exchange(nullptr, std::memory_order_acq_rel);
+        if (c) {
+            // written is 0 if the memory changed shape before it could be
+            // copied; the write stays due, and it's copied again in its new shape
+            if (c->written) {
+                std::string dir = asset::user("minimal-friction");
+                system::createDirectories(dir);
+                system::createDirectories(system::getDirectory(capture_path));
+                std::string tmp = system::join(dir, string::f("terminal-%lld.tmp", (long long) id));
+                FILE* f = std::fopen(tmp.c_str(), "wb");
+                bool ok = f && c->save(f);
+                if (f) ok = std::fclose(f) == 0 && ok;
+                if (!ok || !system::rename(tmp, capture_path)) {
+                    WARN("Could not write Terminal delay memory to %s", capture_path.c_str());
+                    system::remove(tmp);
+                }
+                std::lock_guard<std::mutex> lock(file_mutex);
+                saves_done = capture_request;
+                saved.notify_all();
+            }
+            delete c;
+            capture_path.clear();
+        }
+
+        if (capture_path.empty()) {
+            std::string path;
+            uint64_t request;
+            {
+                std::lock_guard<std::mutex> lock(file_mutex);
+                if (autosave_due.exchange(false) && save_memory && saves_done == save_requests) save_requests++;
+                request = save_requests;
+                if (saves_done < request && save_memory && !storage_dir.empty()) path = memoryPath(storage_dir);
+                else saves_done = request;
+            }
+            // the copy is as large as the memory, so it's allocated without
+            // holding up a save that's waiting
+            if (!path.empty() && core.requestCapture()) {
+                capture_path = path;
+                capture_request = request;
+            }
+            // no memory in use, or nowhere to write it: nothing to write
+            else {
+                std::lock_guard<std::mutex> lock(file_mutex);
+                saves_done = std::max(saves_done, request);
+                saved.notify_all();
+            }
+        }
+    }
+
+    void processControls()
+    {
+        // settings from the context menu
+        uint8_t interpolation = requested_interpolation.load(std::memory_order_acquire);
+        if (interpolation != core.interpolation) core.setInterpolation(interpolation);
+        bool dual_head = requested_dual_head.load(std::memory_order_acquire);
+        if (dual_head != core.dual_head) core.setDualHead(dual_head);
+        uint8_t storage = requested_storage.load(std::memory_order_acquire);
+        if (storage != core.wanted_storage) {
+            core.setStorage(storage);
+            worker.wake();
+        }
+
+        // keeps the delay memory file current for autosaves
+        autosave_frames += CONTROL_DIVISION;
+        if (autosave_frames >= MEMORY_AUTOSAVE_TIME * core.sample_rate) {
+            autosave_frames = 0;
+            if (save_memory.load(std::memory_order_relaxed)) {
+                autosave_due.store(true, std::memory_order_release);
+                worker.wake();
+            }
+        }
+
+        // In long storage the delay knobs and CV reach ten times as far, so
+        // that they keep the same travel and saved positions in every storage.
+        // Only once the long buffer is in, as the one before doesn't reach as far.
+        if (core.maxDelay() != max_delay) {
+            max_delay = core.maxDelay();
+            for (int i = 0; i < 3; i++)
+                paramQuantities[DELAY1_PARAM + i]->displayMultiplier = max_delay / DELAY_MEMORY_SIZE;
+        }
+
+        float range = max_delay / DELAY_MEMORY_SIZE;
+        for (int i = 0; i < 3; i++) {
+            TerminalChannel& chan = channels[i];
+
+            // one delay line per voice of the widest cable feeding the channel
+            chan.voices = 0;
+            if (outputs[DEPARTURE1_L_OUTPUT + i*2].isConnected() || outputs[DEPARTURE1_R_OUTPUT + i*2].isConnected()) {
+                chan.voices = std::max({ 1,
+                    inputs[INPUT_L_INPUT].getChannels(), inputs[INPUT_R_INPUT].getChannels(),
+                    inputs[ARRIVAL1_L_INPUT + i*2].getChannels(), inputs[ARRIVAL1_R_INPUT + i*2].getChannels() });
+            }
+            core.setVoices(i, chan.voices);
+            core.setTaps(i, chan.taps, chan.tap_time, chan.tap_level);
+            core.setInsert(i, chan.clip, chan.filter, chan.cutoffHz());
+
+            chan.setTargets(params[GAIN1_PARAM + i], inputs[GAIN1_MOD_INPUT + i],
+                params[DELAY1_PARAM + i], inputs[DELAY1_MOD_INPUT + i], range);
+
+            // fades the channel out over a few ms before clearing it,
+            // so there's no click, and no memset on the audio thread
+            if (chan.kill_trigger.process(params[KILL1_PARAM + i].getValue()))
+                core.kill(i);
+        }
+
+        // the expanders' channels come after Terminal's own, and are
+        // inactive unless their expander is in the chain
+        const TerminalUpstream* message = expanderMessage();
+        expanders = message ? message->expanders : 0;
+        for (int k = 0; k < MAX_EXPANDERS; k++) {
+            for (int j = 0; j < TERMINAL_CHANNELS; j++) {
+                int i = TERMINAL_CHANNELS * (1 + k) + j;
+                if (k >= expanders) {
+                    core.setVoices(i, 0);
+                    continue;
+                }
+                const TerminalExpanderChannel& chan = message->channels[k][j];
+                core.setVoices(i, chan.voices);
+                if (!chan.voices) continue;
+                core.setTaps(i, chan.taps, chan.tap_time, chan.tap_level);
+                core.setInsert(i, chan.clip, chan.filter, chan.cutoff_hz);
+            }
         }
+
+        if (core.swapBuffers()) worker.wake();
+        else worker.retry();
+    }
+
+    // this frame's message from the expanders, or null if there are none
+    const TerminalUpstream* expanderMessage()
+    {
+        if (!rightExpander.module || rightExpander.module->model != modelTerminalExpander) return nullptr;
+        return (const TerminalUpstream*) rightExpander.consumerMessage;
     }
 
     void process(const ProcessArgs& args) override
     {
-    // TODO: Is this modulation calculation correct?
-    #define DELAY_TIME clamp(params[DELAY1_PARAM + i].getValue() + (inputs[DELAY1_MOD_INPUT + i].getVoltage()) * 3.f/10.f, 0.f, DELAY_MEMORY_SIZE*args.sampleRate)
-    #define GAIN       clamp(params[GAIN1_PARAM + i].getValue() + (inputs[GAIN1_MOD_INPUT + i].getVoltage()) / 10.f, 0.f, 1.f)
-        
+        // The delay lines themselves live in TerminalCore, one per voice of each channel, and
+        // their memory is (re)allocated by the worker thread for the current sample rate and voices.
+        // The kill switches not only fade out the departure output but also clear the delay memory!
+        // Gain and delay time (knob + CV) and the kill buttons are only evaluated at control rate,
+        // the audio loop below just follows their ramps.
 
-        // We implement the singly-tapped delay line with a ring buffer,
-        // whose size is set specifically to the number of samples in 3
-        // seconds of audio, i.e. the maximum delay time.
-        // TODO: implement behavior on sample rate changes
-        // We can view the delay "memory" in two ways:
-        //
-        // 1. A static, (<max delay time> * <samplerate> Hz)-size container where each new sample,
-        //    the contents of the entire array move to make space for the new value.
-        //    In that model, the delay tap, dependent on delay time, is static in one place.
-        // 2. (How it actually works) A (3 seconds * <samplerate> Hz)-size ring buffer where each frame,
-        //    if the container is full, the oldest element is overwritten with the value of the new sample
-        //    and our tap pointer is moved one element forward and also moved accordingly to the delay time
-        //    changes.
-        // The kill switches not only clear the departure output but also the delay memory!
+        bool timed = timer.start();
 
+        if (control.process()) processControls();
+
+        const LaneLayout& layout = core.layout;
         for (int i = 0; i < 3; i++) {
-            Channel& chan = channels[i];
-            chan.memory.first[chan.write]  = inputs[ARRIVAL1_L_INPUT + i*2].getVoltage();
-            chan.memory.second[chan.write] = inputs[ARRIVAL1_R_INPUT + i*2].getVoltage();
-            
-            // how far back in the ring buffer we have to go to reach the appropriate delayed sample
-            size_t setback = (size_t)roundf(args.sampleRate * DELAY_TIME);
-
-            size_t delay_location = (chan.write - setback + memory_size) % memory_size;
-
-            outputs[DEPARTURE1_L_OUTPUT + i*2].setVoltage(inputs[INPUT_L_INPUT].getVoltage() + chan.memory.first[delay_location] * GAIN);
-            outputs[DEPARTURE1_R_OUTPUT + i*2].setVoltage(inputs[INPUT_R_INPUT].getVoltage() + chan.memory.second[delay_location] * GAIN);
-
-            chan.write++;
-            chan.write %= memory_size;
-
-            // TODO: this should be more performant. As it is, holding down the button makes
-            // TODO: unpleasant distorted noises (which don't make it recordings made with the
-            // TODO: VCV recorder module, but are nonetheless broadcasted through the audio module).
-            // TODO: This should be fixed with an amplitude fade-out over several frames; look
-            // TODO: into how that works.
-            if (kill_trigger.process(params[KILL1_PARAM + i].getValue())) {
-                outputs[DEPARTURE1_L_OUTPUT + i*2].setVoltage(0.f);
-                outputs[DEPARTURE1_R_OUTPUT + i*2].setVoltage(0.f);
-
-                std::memset(static_cast<void*>(chan.memory.first.data()), 0, sizeof(float) * memory_size);
-                std::memset(static_cast<void*>(chan.memory.second.data()), 0, sizeof(float) * memory_size);
-                chan.write = 0;
+            channels[i].processRamps(gain + layout.offset[i], delay_time + layout.offset[i], layout.voices[i]);
+            for (int v = 0; v < layout.voices[i]; v++) {
+                int lane = layout.offset[i] + v;
+                input[0][lane] = inputs[INPUT_L_INPUT].getPolyVoltage(v);
+                input[1][lane] = inputs[INPUT_R_INPUT].getPolyVoltage(v);
+                arrival[0][lane] = inputs[ARRIVAL1_L_INPUT + i*2].getPolyVoltage(v);
+                arrival[1][lane] = inputs[ARRIVAL1_R_INPUT + i*2].getPolyVoltage(v);
+            }
+        }
+
+        // The expanders' channels share Terminal's input; the rest of
+        // their lanes comes from the expanders, already as ramped values.
+        const TerminalUpstream* message = expanders ? expanderMessage() : nullptr;
+        if (message) {
+            for (int k = 0; k < expanders; k++) {
+                for (int j = 0; j < TERMINAL_CHANNELS; j++) {
+                    int i = TERMINAL_CHANNELS * (1 + k) + j;
+                    const TerminalExpanderChannel& chan = message->channels[k][j];
+                    int voices = std::min(layout.voices[i], chan.voices);
+                    for (int v = 0; v < voices; v++) {
+                        int lane = layout.offset[i] + v;
+                        input[0][lane] = inputs[INPUT_L_INPUT].getPolyVoltage(v);
+                        input[1][lane] = inputs[INPUT_R_INPUT].getPolyVoltage(v);
+                        arrival[0][lane] = chan.arrival[0][v];
+                        arrival[1][lane] = chan.arrival[1][v];
+                        gain[lane] = chan.gain[v];
+                        delay_time[lane] = chan.delay_time[v];
+                    }
+                    if (chan.voices && chan.kill) core.kill(i);
+                }
+            }
+        }
+
+        core.process(input, arrival, gain, delay_time, departure);
+        meter.process(departure[0], departure[1], layout.lanes);
+
+        for (int i = 0; i < 3; i++) {
+            int voices = channels[i].voices;
+            if (!voices) continue;
+            outputs[DEPARTURE1_L_OUTPUT + i*2].setChannels(voices);
+            outputs[DEPARTURE1_R_OUTPUT + i*2].setChannels(voices);
+            for (int v = 0; v < voices; v++) {
+                // until the memory for a new voice has arrived, it has nothing to mix in yet
+                bool ready = v < layout.voices[i];
+                int lane = layout.offset[i] + v;
+                outputs[DEPARTURE1_L_OUTPUT + i*2].setVoltage(ready ? departure[0][lane] : inputs[INPUT_L_INPUT].getPolyVoltage(v), v);
+                outputs[DEPARTURE1_R_OUTPUT + i*2].setVoltage(ready ? departure[1][lane] : inputs[INPUT_R_INPUT].getPolyVoltage(v), v);
+            }
+        }
+
+        if (rightExpander.module && rightExpander.module->model == modelTerminalExpander)
+            sendDownstream(message);
+
+        if (timed) timer.stop();
+        if (meter.frames >= TELEMETRY_WINDOW) publishTelemetry();
+    }
+
+    // Sums up the window for the UI thread, and lights up the level
+    // meters from it.
+    void publishTelemetry()
+    {
+        TerminalTelemetry& t = telemetry.write();
+        const LaneLayout& layout = core.layout;
+        t.window = window++;
+        timer.summarize(t.time);
+        t.lanes = layout.lanes;
+        t.memory = core.memoryBytes();
+        t.fill = core.fill();
+
+        for (int i = 0; i < TerminalCore::CHANNELS; i++) {
+            int voices = layout.voices[i];
+            float peak = 0.f;
+            for (int lane = layout.offset[i]; lane < layout.offset[i] + voices; lane++)
+                peak = std::max(peak, meter.peak[lane]);
+            float rms = meter.rms(layout.offset[i], voices);
+
+            rising[i] = rms > last_rms[i] ? std::min(rising[i] + 1, 255) : 0;
+            if (peak < RUNAWAY_LEVEL) runaway[i] = false;
+            else if (rising[i] >= RUNAWAY_WINDOWS) runaway[i] = true;
+            last_rms[i] = rms;
+
+            t.voices[i] = voices;
+            t.peak[i] = peak;
+            t.rms[i] = rms;
+            t.runaway[i] = runaway[i];
+        }
+        telemetry.publish();
+        meter.reset();
+
+        for (int i = 0; i < 3; i++) {
+            lights[LEVEL1_GREEN_LIGHT + i*2].setBrightness(runaway[i] ? 0.f : std::min(t.peak[i] / RUNAWAY_LEVEL, 1.f));
+            lights[LEVEL1_RED_LIGHT + i*2].setBrightness(runaway[i]);
+        }
+    }
+
+    // Hands the expanders their departures, and what else they need to
+    // know from Terminal.
+    void sendDownstream(const TerminalUpstream* message)
+    {
+        TerminalDownstream* downstream = (TerminalDownstream*) rightExpander.module->leftExpander.producerMessage;
+        const LaneLayout& layout = core.layout;
+        downstream->position = 0;
+        downstream->input_voices = std::max({ 1, inputs[INPUT_L_INPUT].getChannels(), inputs[INPUT_R_INPUT].getChannels() });
+        downstream->max_delay = core.maxDelay();
+        for (int k = 0; message && k < expanders; k++) {
+            for (int j = 0; j < TERMINAL_CHANNELS; j++) {
+                int i = TERMINAL_CHANNELS * (1 + k) + j;
+                for (int v = 0; v < message->channels[k][j].voices; v++) {
+                    // as for Terminal's own channels
+                    bool ready = v < layout.voices[i];
+                    int lane = layout.offset[i] + v;
+                    downstream->departure[k][j][0][v] = ready ? departure[0][lane] : inputs[INPUT_L_INPUT].getPolyVoltage(v);
+                    downstream->departure[k][j][1][v] = ready ? departure[1][lane] : inputs[INPUT_R_INPUT].getPolyVoltage(v);
+                }
             }
+        }
+        rightExpander.module->leftExpander.requestMessageFlip();
+    }
 
+    json_t *dataToJson() override
+    {
+        json_t *rootJ = json_object();
+
+        json_object_set_new(rootJ, "interpolation", json_integer(requested_interpolation.load()));
+        json_object_set_new(rootJ, "dual_head", json_boolean(requested_dual_head.load()));
+        json_object_set_new(rootJ, "storage", json_integer(requested_storage.load()));
+        json_object_set_new(rootJ, "save_memory", json_boolean(save_memory.load()));
+
+        json_t *tapsJ = json_array();
+        json_t *insertsJ = json_array();
+        for (int i = 0; i < 3; i++) {
+            json_array_append_new(tapsJ, channels[i].tapsToJson());
+            json_array_append_new(insertsJ, channels[i].insertToJson());
         }
+        json_object_set_new(rootJ, "taps", tapsJ);
+        json_object_set_new(rootJ, "inserts", insertsJ);
 
-    #undef GAIN
-    #undef DELAY_TIME
+        return rootJ;
+    }
+
+    void dataFromJson(json_t *rootJ) override
+    {
+        // both missing in patches from before they existed, i.e. linear, single head
+        setInterpolation(json_integer_value(json_object_get(rootJ, "interpolation")));
+        setDualHead(json_boolean_value(json_object_get(rootJ, "dual_head")));
+        // missing in patches from before it existed, i.e. floats
+        setStorage(json_integer_value(json_object_get(rootJ, "storage")));
+        setSaveMemory(json_boolean_value(json_object_get(rootJ, "save_memory")));
+
+        json_t *tapsJ = json_object_get(rootJ, "taps");
+        json_t *insertsJ = json_object_get(rootJ, "inserts");
+        for (int i = 0; i < 3; i++) {
+            channels[i].tapsFromJson(json_array_get(tapsJ, i));
+            channels[i].insertFromJson(json_array_get(insertsJ, i));
+        }
+    }
+
+    void onReset() override
+    {
+        setInterpolation(TerminalCore::LINEAR);
+        setDualHead(false);
+        setStorage(STORAGE_FLOAT);
+        setSaveMemory(false);
+        for (int i = 0; i < 3; i++) {
+            channels[i].resetTaps();
+            channels[i].resetInsert();
+        }
     }
 };
 
+constexpr float TerminalChannel::DEFAULT_CUTOFF;
+constexpr float TerminalChannel::DEFAULT_TAP_TIME[];
+constexpr float TerminalChannel::DEFAULT_TAP_LEVEL[];
+
 struct TerminalWidget : ModuleWidget {
     TerminalWidget(Terminal* module) {
         setModule(module);
@@ -206,6 +636,80 @@ struct TerminalWidget : ModuleWidget {
         addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(33.61, 70.65)), module, Terminal::DEPARTURE2_R_OUTPUT));
         addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(33.61, 97.26)), module, Terminal::DEPARTURE3_L_OUTPUT));
         addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(33.61, 107.62)), module, Terminal::DEPARTURE3_R_OUTPUT));
+
+        // lights
+        addChild(createLightCentered<SmallLight<GreenRedLight>>(mm2px(Vec(47.75, 24.4)), module, Terminal::LEVEL1_GREEN_LIGHT));
+        addChild(createLightCentered<SmallLight<GreenRedLight>>(mm2px(Vec(47.75, 61.38)), module, Terminal::LEVEL2_GREEN_LIGHT));
+        addChild(createLightCentered<SmallLight<GreenRedLight>>(mm2px(Vec(47.75, 98.35)), module, Terminal::LEVEL3_GREEN_LIGHT));
+    }
+
+    // while recording, one CSV line per telemetry window
+    TelemetryLog log;
+
+    void step() override
+    {
+        ModuleWidget::step();
+        Terminal* module = getModule<Terminal>();
+        if (!module || !module->telemetry.update() || !log.file) return;
+
+        const TerminalTelemetry& t = module->telemetry.latest();
+        std::fprintf(log.file, "%u,%.0f,%.0f,%.0f,%d,%llu,%.4f", t.window, t.time.min, t.time.avg, t.time.p99, t.lanes, (unsigned long long) t.memory, t.fill);
+        for (int i = 0; i < TerminalCore::CHANNELS; i++)
+            std::fprintf(log.file, ",%d,%.4f,%.4f,%d", t.voices[i], t.peak[i], t.rms[i], t.runaway[i]);
+        std::fprintf(log.file, "\n");
+    }
+
+    void startLog()
+    {
+        std::string header = "window,min_ns,avg_ns,p99_ns,lanes,memory_bytes,fill";
+        for (int i = 1; i <= TerminalCore::CHANNELS; i++)
+            header += string::f(",ch%d_voices,ch%d_peak,ch%d_rms,ch%d_runaway", i, i, i, i);
+        std::string dir = asset::user("minimal-friction");
+        system::createDirectories(dir);
+        log.start(system::join(dir, string::f("terminal-%lld.csv", (long long) module->id)), header.c_str());
+    }
+
+    void appendContextMenu(Menu* menu) override
+    {
+        Terminal* module = getModule<Terminal>();
+
+        menu->addChild(new MenuSeparator);
+        menu->addChild(createIndexSubmenuItem("Delay interpolation", {"Linear", "Cubic (Hermite)", "Allpass"},
+            [=]() { return module->requested_interpolation.load(); },
+            [=](size_t i) { module->setInterpolation(i); }
+        ));
+        menu->addChild(createBoolMenuItem("Crossfade delay time jumps", "",
+            [=]() { return module->requested_dual_head.load(); },
+            [=](bool d) { module->setDualHead(d); }
+        ));
+        menu->addChild(createIndexSubmenuItem("Delay memory", {"32-bit, 3 s", "16-bit, 3 s (half the memory)", "16-bit, 30 s"},
+            [=]() { return module->requested_storage.load(); },
+            [=](size_t s) { module->setStorage(s); }
+        ));
+        menu->addChild(createBoolMenuItem("Save delay memory with the patch", "",
+            [=]() { return module->save_memory.load(); },
+            [=](bool s) { module->setSaveMemory(s); }
+        ));
+
+        for (int i = 0; i < 3; i++) module->channels[i].appendTapsMenu(menu, i+1);
+        for (int i = 0; i < 3; i++) module->channels[i].appendInsertMenu(menu, i+1);
+
+        menu->addChild(createSubmenuItem("Telemetry", "", [=](Menu* menu) {
+            const TerminalTelemetry& t = module->telemetry.latest();
+            menu->addChild(createMenuLabel(string::f("process(): %.0f / %.0f / %.0f ns (min / avg / p99)", t.time.min, t.time.avg, t.time.p99)));
+            menu->addChild(createMenuLabel(string::f("Delay memory: %.1f MB, %.0f%% filled, %d lanes", t.memory / 1e6, t.fill * 100.f, t.lanes)));
+            for (int i = 0; i < TerminalCore::CHANNELS; i++) {
+                if (!t.voices[i]) continue;
+                // the expanders' channels go on from 4
+                menu->addChild(createMenuLabel(string::f("Channel %d: %d voices, %.2f V peak, %.2f V RMS%s",
+                    i+1, t.voices[i], t.peak[i], t.rms[i], t.runaway[i] ? ", running away" : "")));
+            }
+            menu->addChild(createBoolMenuItem("Record to file", "",
+                [=]() { return log.file != nullptr; },
+                [=](bool r) { if (r) startLog(); else log.stop(); }
+            ));
+            if (log.file) menu->addChild(createMenuLabel(log.path));
+        }));
     }
 };
 
@@ -0,0 +1,248 @@
+#pragma once
+#include "plugin.hpp"
+#include "widgets.hpp"
+#include "control.hpp"
+#include "telemetry.hpp"
+#include "terminal_core.hpp"
+
+// What Terminal and its expanders have in common: a channel's controls,
+// the messages they pass each other, and what Terminal tells about them all.
+
+
+// One Terminal channel's controls: the ramps its knobs and CV are followed
+// with, and the settings from the context menu. The delay line itself lives
+// in Terminal's TerminalCore, expander channels' too.
+struct TerminalChannel {
+    // knob + CV, evaluated at control rate, 4 voices per ramp
+    LinearRamp<simd::float_4> gain[4];
+    LinearRamp<simd::float_4> delay_time[4];
+    dsp::BooleanTrigger kill_trigger;
+    // voices on the Departure outputs, 0 if neither is patched
+    int voices = 1;
+
+    // set in the context menu; tap 0 is the one at the delay time
+    int taps = 1;
+    float tap_time[TerminalCore::MAX_TAPS];
+    float tap_level[TerminalCore::MAX_TAPS];
+
+    // in-loop processing, also set in the context menu
+    bool clip = false;
+    uint8_t filter = TerminalCore::FILTER_OFF;
+    // 0 to 1, from 20 Hz to 20 kHz
+    float cutoff = DEFAULT_CUTOFF;
+
+    // 1 kHz
+    static constexpr float DEFAULT_CUTOFF = 0.5663f;
+    // extra taps start out as evenly spaced, fading echoes
+    static constexpr float DEFAULT_TAP_TIME[TerminalCore::MAX_TAPS] = { 1.f, 0.75f, 0.5f, 0.25f };
+    static constexpr float DEFAULT_TAP_LEVEL[TerminalCore::MAX_TAPS] = { 1.f, 0.5f, 0.5f, 0.5f };
+
+    TerminalChannel()
+    {
+        resetTaps();
+    }
+
+    inline float cutoffHz() const
+    {
+        return 20.f * std::pow(1000.f, cutoff);
+    }
+
+    void resetTaps()
+    {
+        taps = 1;
+        for (int t = 0; t < TerminalCore::MAX_TAPS; t++) {
+            tap_time[t] = DEFAULT_TAP_TIME[t];
+            tap_level[t] = DEFAULT_TAP_LEVEL[t];
+        }
+    }
+
+    void resetInsert()
+    {
+        clip = false;
+        filter = TerminalCore::FILTER_OFF;
+        cutoff = DEFAULT_CUTOFF;
+    }
+
+    // Control rate. range scales the delay knob and CV to the delay memory
+    // (see Terminal::processControls()).
+    void setTargets(Param& gain_param, Input& gain_mod, Param& delay_param, Input& delay_mod, float range)
+    {
+        for (int b = 0; b < 4; b++) {
+            // TODO: Is this modulation calculation correct?
+            delay_time[b].setTarget(simd::clamp(delay_param.getValue()
+                + delay_mod.getPolyVoltageSimd<simd::float_4>(b*4) * 3.f/10.f, 0.f, (float)DELAY_MEMORY_SIZE) * range);
+            gain[b].setTarget(simd::clamp(gain_param.getValue()
+                + gain_mod.getPolyVoltageSimd<simd::float_4>(b*4) / 10.f, 0.f, 1.f));
+        }
+    }
+
+    // Advances the ramps of the first n voices by a frame, into one float per voice.
+    void processRamps(float* lane_gain, float* lane_delay_time, int n)
+    {
+        for (int b = 0; b * 4 < n; b++) {
+            float g[4], d[4];
+            gain[b].process().store(g);
+            delay_time[b].process().store(d);
+            for (int v = b*4; v < std::min(b*4 + 4, n); v++) {
+                lane_gain[v] = g[v - b*4];
+                lane_delay_time[v] = d[v - b*4];
+            }
+        }
+    }
+
+    json_t *tapsToJson() const
+    {
+        json_t *channelJ = json_object();
+        json_t *timeJ = json_array();
+        json_t *levelJ = json_array();
+        for (int t = 0; t < TerminalCore::MAX_TAPS; t++) {
+            json_array_append_new(timeJ, json_real(tap_time[t]));
+            json_array_append_new(levelJ, json_real(tap_level[t]));
+        }
+        json_object_set_new(channelJ, "count", json_integer(taps));
+        json_object_set_new(channelJ, "time", timeJ);
+        json_object_set_new(channelJ, "level", levelJ);
+        return channelJ;
+    }
+
+    // missing in patches from before multi-tap, i.e. a single tap
+    void tapsFromJson(json_t *channelJ)
+    {
+        resetTaps();
+        if (!channelJ) return;
+        taps = clamp((int) json_integer_value(json_object_get(channelJ, "count")), 1, TerminalCore::MAX_TAPS);
+        for (int t = 1; t < TerminalCore::MAX_TAPS; t++) {
+            json_t *timeJ = json_array_get(json_object_get(channelJ, "time"), t);
+            json_t *levelJ = json_array_get(json_object_get(channelJ, "level"), t);
+            if (timeJ) tap_time[t] = clamp((float) json_number_value(timeJ), 0.f, 1.f);
+            if (levelJ) tap_level[t] = clamp((float) json_number_value(levelJ), 0.f, 1.f);
+        }
+    }
+
+    json_t *insertToJson() const
+    {
+        json_t *insertJ = json_object();
+        json_object_set_new(insertJ, "clip", json_boolean(clip));
+        json_object_set_new(insertJ, "filter", json_integer(filter));
+        json_object_set_new(insertJ, "cutoff", json_real(cutoff));
+        return insertJ;
+    }
+
+    // missing in patches from before inserts, i.e. none
+    void insertFromJson(json_t *insertJ)
+    {
+        json_t *cutoffJ = json_object_get(insertJ, "cutoff");
+        clip = json_boolean_value(json_object_get(insertJ, "clip"));
+        filter = json_integer_value(json_object_get(insertJ, "filter")) % TerminalCore::FILTERS_LEN;
+        cutoff = cutoffJ ? clamp((float) json_number_value(cutoffJ), 0.f, 1.f) : DEFAULT_CUTOFF;
+    }
+
+    void appendTapsMenu(Menu* menu, int number)
+    {
+        std::vector<std::string> counts;
+        for (int n = 1; n <= TerminalCore::MAX_TAPS; n++) counts.push_back(string::f("%d", n));
+        menu->addChild(createSubmenuItem(string::f("Channel %d taps", number), string::f("%d", taps), [=](Menu* menu) {
+            menu->addChild(createIndexSubmenuItem("Taps", counts,
+                [=]() { return taps - 1; },
+                [=](size_t n) { taps = n + 1; }
+            ));
+            // as fractions of the channel's delay time and level
+            for (int t = 1; t < taps; t++) {
+                menu->addChild(new MF_MenuSlider(string::f("Tap %d time", t+1), &tap_time[t], DEFAULT_TAP_TIME[t]));
+                menu->addChild(new MF_MenuSlider(string::f("Tap %d level", t+1), &tap_level[t], DEFAULT_TAP_LEVEL[t]));
+            }
+        }));
+    }
+
+    void appendInsertMenu(Menu* menu, int number)
+    {
+        menu->addChild(createSubmenuItem(string::f("Channel %d insert", number), "", [=](Menu* menu) {
+            menu->addChild(createIndexSubmenuItem("Filter", {"Off", "Low-pass", "High-pass"},
+                [=]() { return filter; },
+                [=](size_t f) { filter = f; }
+            ));
+            menu->addChild(new MF_MenuSlider("Cutoff", &cutoff, DEFAULT_CUTOFF, " Hz", 1000.f, 20.f));
+            menu->addChild(createBoolPtrMenuItem("Soft clip", "", &clip));
+        }));
+    }
+};
+
+
+/*==- EXPANDER MESSAGES -==*/
+
+// Expanders sit to the right of Terminal, up to MAX_EXPANDERS of them, and
+// add TERMINAL_CHANNELS channels each, which run in Terminal's TerminalCore
+// next to its own. Every frame, Terminal sends a TerminalDownstream to the
+// first expander, which passes it on to the next one, and so on; on the way
+// back, each expander fills in its channels in the TerminalUpstream it got
+// from its right and sends it to its left. Both go through Rack's
+// double-buffered expander messages, so no module ever waits for another,
+// but every hop takes a frame: the expander at position k (0 for the one
+// next to Terminal) is k + 1 frames behind it, each way.
+
+// an expander channel, as Terminal needs it
+struct TerminalExpanderChannel {
+    // 0 while the channel is inactive, in which case nothing else is set
+    uint8_t voices;
+    // this frame, per voice
+    float arrival[2][LaneLayout::MAX_VOICES];
+    float gain[LaneLayout::MAX_VOICES];
+    float delay_time[LaneLayout::MAX_VOICES];
+    // set for a single frame when the kill button is pressed
+    bool kill;
+    // control rate settings, see TerminalChannel
+    uint8_t taps;
+    float tap_time[TerminalCore::MAX_TAPS];
+    float tap_level[TerminalCore::MAX_TAPS];
+    bool clip;
+    uint8_t filter;
+    float cutoff_hz;
+};
+
+// from the expanders, towards Terminal
+struct TerminalUpstream {
+    // the channels of the expander at position k are channels[k]
+    TerminalExpanderChannel channels[MAX_EXPANDERS][TERMINAL_CHANNELS];
+    // the expanders at positions from 0 up to this one are in the chain
+    int expanders = 0;
+};
+
+// from Terminal, towards the expanders
+struct TerminalDownstream {
+    // of the expander it's sent to
+    int position = 0;
+    // voices of Terminal's input, which expander channels are at least as wide as
+    int input_voices = 1;
+    // how far the delay knobs reach, see Terminal::processControls()
+    float max_delay = DELAY_MEMORY_SIZE;
+    // the expander at position k's Departure outputs, per voice, for the
+    // voices it asked for at the time
+    float departure[MAX_EXPANDERS][TERMINAL_CHANNELS][2][LaneLayout::MAX_VOICES] = {};
+};
+
+
+/*==- TELEMETRY -==*/
+
+// A channel has run away, i.e. its feedback keeps building up, once its
+// level has risen for RUNAWAY_WINDOWS telemetry windows in a row with its
+// peak past RUNAWAY_LEVEL volts, and until its peak falls back below that.
+#define RUNAWAY_LEVEL 10.f
+#define RUNAWAY_WINDOWS 4
+
+// what Terminal publishes every TELEMETRY_WINDOW frames
+struct TerminalTelemetry {
+    // counts up by one per window, so that a log shows any it skipped
+    uint32_t window;
+    ProcessTime time;
+    // lanes in use, the delay memory they take up in bytes, and the
+    // fraction of it that holds signal, i.e. has been written since it
+    // was allocated
+    int lanes;
+    size_t memory;
+    float fill;
+    // per channel, the expanders' included; peak and RMS of the departures
+    uint8_t voices[LaneLayout::CHANNELS];
+    float peak[LaneLayout::CHANNELS];
+    float rms[LaneLayout::CHANNELS];
+    bool runaway[LaneLayout::CHANNELS];
+};
@@ -0,0 +1,1247 @@
+#pragma once
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <algorithm>
+#include <atomic>
+#include <utility>
+#include <vector>
+#include <simd/Vector.hpp>
+#include <simd/functions.hpp>
+#include "approx.hpp"
+
+using namespace rack;
+
+// maximum delay time, in seconds
+#define DELAY_MEMORY_SIZE 3
+// how long a killed channel takes to fade out, in seconds
+#define KILL_FADE_TIME 0.005f
+// in dual-head mode, a delay time change of more than this many seconds
+// from one frame to the next is a jump, and gets crossfaded instead of swept
+#define DUAL_HEAD_JUMP 0.001f
+// and the crossfade takes this long, in seconds
+#define DUAL_HEAD_FADE_TIME 0.02f
+// maximum delay time in long storage, in seconds
+#define LONG_DELAY_MEMORY_SIZE 30
+// compact storage maps +-COMPACT_RANGE volts to 16 bits, and saturates beyond
+#define COMPACT_RANGE 16.f
+#define COMPACT_SCALE (32768.f / COMPACT_RANGE)
+// the insert's soft clipper levels off at +-this many volts
+#define INSERT_CLIP_LEVEL 5.f
+// Terminal's own channels, and how many more each expander adds
+#define TERMINAL_CHANNELS 3
+// how many expanders one Terminal takes on
+#define MAX_EXPANDERS 3
+// a copy of the delay memory takes at least this many bytes per
+// swapBuffers() call, see TerminalCore::captureFrames()
+#define CAPTURE_BYTES 65536
+// Terminal writes its delay memory to the patch storage this often, in
+// seconds, as often as Rack autosaves by default
+#define MEMORY_AUTOSAVE_TIME 15.f
+// and saving the patch waits this long at most, in seconds, for a write
+// underway to finish
+#define SAVE_FLUSH_TIME 0.25f
+
+
+// How delay memory stores its samples: as 32-bit floats, or as 16-bit
+// fixed point, for half the memory and memory bandwidth at the same
+// maximum delay time, or for ten times the delay time in five times the memory.
+enum DelayStorage {
+    STORAGE_FLOAT,
+    STORAGE_COMPACT,
+    STORAGE_LONG,
+    STORAGE_LEN
+};
+
+// maximum delay time, in seconds
+static inline float storageSeconds(uint8_t storage)
+{
+    return storage == STORAGE_LONG ? LONG_DELAY_MEMORY_SIZE : DELAY_MEMORY_SIZE;
+}
+
+
+// Which lanes of a DelayBuffer belong to which channel. Each polyphonic
+// voice of each channel is a delay line, and a lane, of its own. Channels
+// past TERMINAL_CHANNELS are the expanders', in the order they're chained in.
+struct LaneLayout {
+    static const int CHANNELS = TERMINAL_CHANNELS * (1 + MAX_EXPANDERS);
+    static const int MAX_VOICES = 16;
+    static const int MAX_LANES = CHANNELS * MAX_VOICES;
+
+    // channel i has voices[i] lanes (none while it's inactive), from offset[i] on
+    uint8_t voices[CHANNELS] = {};
+    uint8_t offset[CHANNELS] = {};
+    int lanes = 0;
+
+    void set(int i, int v)
+    {
+        voices[i] = v;
+        lanes = 0;
+        for (int c = 0; c < CHANNELS; c++) {
+            offset[c] = lanes;
+            lanes += voices[c];
+        }
+    }
+
+    bool operator==(const LaneLayout& other) const
+    {
+        return std::equal(voices, voices + CHANNELS, other.voices);
+    }
+    bool operator!=(const LaneLayout& other) const { return !(*this == other); }
+
+    // Calls f(from_lane, to_lane) for every voice the two layouts have in common.
+    template <typename F>
+    static void match(const LaneLayout& from, const LaneLayout& to, F f)
+    {
+        for (int c = 0; c < CHANNELS; c++)
+            for (int v = 0; v < std::min(from.voices[c], to.voices[c]); v++)
+                f(from.offset[c] + v, to.offset[c] + v);
+    }
+};
+
+
+// The memory of several stereo, singly-tapped delay lines, one lane each.
+//
+// We implement it with a ring buffer, whose size is set specifically to
+// the number of samples in 3 seconds of audio, i.e. the maximum delay time.
+// Positions only ever move by less than a whole ring at a time, so they wrap
+// around with a compare and subtract rather than a modulo. (Rounding the
+// size up to a power of two would make that a mask, but nearly double the
+// memory at 44.1 and 48 kHz, for no measurable gain.) We can view the delay
+// "memory" in two ways:
+//
+// 1. A static, (<max delay time> * <samplerate> Hz)-size container where each new sample,
+//    the contents of the entire array move to make space for the new value.
+//    In that model, the delay tap, dependent on delay time, is static in one place.
+// 2. (How it actually works) A (3 seconds * <samplerate> Hz)-size ring buffer where each frame,
+//    if the container is full, the oldest element is overwritten with the value of the new sample
+//    and our tap pointer is moved one element forward and also moved accordingly to the delay time
+//    changes.
+//
+// All lines share one allocation, interleaved frame by frame: the left
+// samples of every lane, then the right ones. Writing a frame is then a few
+// vector stores into one cache line or two, instead of a scalar store into
+// a separate array per line and side. Frames aren't padded to a multiple of
+// 4 lanes, which would more than double the memory of a mono or stereo
+// Terminal; the lanes past the last group of 4 are stored one by one.
+//
+// Samples are stored either as floats, or in 16-bit fixed point (see
+// DelayStorage), for half the memory and memory bandwidth per frame.
+//
+// Buffers are only ever allocated and freed by TerminalCore::prepareBuffers(),
+// off the audio thread, and are sized for the one sample rate, LaneLayout
+// and storage they were made for.
+struct DelayBuffer {
+    std::vector<float> memory;
+    // instead of memory, in compact storage
+    std::vector<int16_t> compact_memory;
+    float sample_rate;
+    LaneLayout layout;
+    uint8_t storage;
+    // in frames
+    size_t size;
+    // samples per side of a frame, one per lane
+    size_t stride;
+    size_t write = 0;
+    // Frames written so far, and how many had been written when each lane
+    // was last cleared. Anything further back than their difference is
+    // stale and reads as silence, so clearing takes no more than a store.
+    uint64_t written = 0;
+    std::vector<uint64_t> cleared;
+    // xorshift state for the dither, one generator per vector lane
+    simd::int32_4 dither_state = simd::int32_4(0x2545f491, 0x4f6cdd1d, 0x1b873593, 0x6c078965);
+
+    DelayBuffer(float sr, const LaneLayout& l, uint8_t s = STORAGE_FLOAT)
+        : sample_rate(sr), layout(l), storage(s), size(ringSize(sr, s)), stride(std::max(l.lanes, 1))
+    {
+        if (isCompact()) compact_memory.assign(size * 2 * stride, 0);
+        else memory.assign(size * 2 * stride, 0.f);
+        cleared.assign(stride, 0);
+    }
+
+    // The maximum delay time, and the frames around it the interpolating taps read.
+    static size_t ringSize(float sr, uint8_t storage)
+    {
+        return (size_t) (storageSeconds(storage) * sr) + 4;
+    }
+
+    // The frame n frames before the write position, for n up to size. Past
+    // the start of the ring, write - n wraps around to way beyond its end,
+    // and adding size wraps it back to where it belongs.
+    inline size_t back(size_t n) const
+    {
+        size_t i = write - n;
+        return i < size ? i : i + size;
+    }
+
+    inline bool isCompact() const
+    {
+        return storage != STORAGE_FLOAT;
+    }
+
+    inline size_t filled(int lane) const
+    {
+        return (size_t) std::min<uint64_t>(written - cleared[lane], size);
+    }
+
+    inline size_t bytes() const
+    {
+        return memory.size() * sizeof(float) + compact_memory.size() * sizeof(int16_t);
+    }
+
+    // Fills this buffer with the contents of one made for another sample
+    // rate or storage, linearly interpolated, so that whatever is in the
+    // loop keeps its pitch and timing across the change. Voices that only
+    // exist in one of the two layouts are left out.
+    void resampleFrom(const DelayBuffer& old)
+    {
+        double ratio = (double) old.sample_rate / sample_rate;
+        std::vector<int> from(stride, -1);
+        std::vector<size_t> old_filled(stride, 0), new_filled(stride, 0);
+        size_t longest = 0;
+        LaneLayout::match(old.layout, layout, [&](int a, int b) {
+            from[b] = a;
+            old_filled[b] = old.filled(a);
+            longest = std::max(longest, old_filled[b]);
+        });
+
+        // i frames back from the write position here is i * ratio frames back there
+        for (size_t i = 1; i < size; i++) {
+            double back = i * ratio;
+            size_t whole = (size_t) back;
+            float frac = (float) (back - whole);
+            // nothing newer than the last frame written there
+            if (whole == 0) {
+                whole = 1;
+                frac = 0.f;
+            }
+            if (whole + 1 > longest) break;
+            size_t a = old.back(whole) * 2 * old.stride;
+            size_t b = old.back(whole + 1) * 2 * old.stride;
+            size_t here = (size - i) * 2 * stride;
+            for (int lane = 0; lane < layout.lanes; lane++) {
+                int o = from[lane];
+                if (o < 0) continue;
+                for (size_t side = 0; side < 2; side++) {
+                    float x = old.sample(a + side * old.stride + o);
+                    float y = old.sample(b + side * old.stride + o);
+                    setSample(here + side * stride + lane, x + (y - x) * frac);
+                }
+                if (whole + 1 <= old_filled[lane]) new_filled[lane] = i;
+            }
+        }
+        write = 0;
+        written = size;
+        for (size_t lane = 0; lane < stride; lane++) cleared[lane] = size - new_filled[lane];
+    }
+
+    // Copies frame from of other, which has the same storage, into frame
+    // to, one lane at a time: into each lane, other's lane lanes[lane], if
+    // there is one.
+    void copyFrame(const DelayBuffer& other, size_t from, size_t to, const int16_t* lanes)
+    {
+        from *= 2 * other.stride;
+        to *= 2 * stride;
+        for (int lane = 0; lane < layout.lanes; lane++) {
+            int o = lanes[lane];
+            if (o < 0) continue;
+            for (size_t side = 0; side < 2; side++) {
+                if (isCompact()) compact_memory[to + side * stride + lane] = other.compact_memory[from + side * other.stride + o];
+                else memory[to + side * stride + lane] = other.memory[from + side * other.stride + o];
+            }
+        }
+    }
+
+    // Copies n frames of other, which has the same size, stride and
+    // storage, from frame first on, wrapping around.
+    void copyFrames(const DelayBuffer& other, size_t first, size_t n)
+    {
+        while (n > 0) {
+            size_t run = std::min(n, size - first);
+            size_t from = first * 2 * stride, count = run * 2 * stride;
+            if (isCompact()) std::copy(&other.compact_memory[from], &other.compact_memory[from] + count, &compact_memory[from]);
+            else std::copy(&other.memory[from], &other.memory[from] + count, &memory[from]);
+            first += run;
+            if (first == size) first = 0;
+            n -= run;
+        }
+    }
+
+    // The buffer as a file: a header, the write position and clear
+    // counts, then every frame just as it is in memory, in native byte order.
+    static const uint32_t FILE_MAGIC = 0x4c44464d; // "MFDL"
+    // 2: rings exactly as long as the maximum delay, frames not padded to 4 lanes
+    static const uint32_t FILE_VERSION = 2;
+
+    bool save(FILE* f) const
+    {
+        uint32_t header[2] = { FILE_MAGIC, FILE_VERSION };
+        uint64_t position[4] = { size, stride, write, written };
+        bool ok = std::fwrite(header, sizeof(header), 1, f) == 1
+            && std::fwrite(&sample_rate, sizeof(sample_rate), 1, f) == 1
+            && std::fwrite(&storage, sizeof(storage), 1, f) == 1
+            && std::fwrite(layout.voices, 1, LaneLayout::CHANNELS, f) == LaneLayout::CHANNELS
+            && std::fwrite(position, sizeof(position), 1, f) == 1
+            && std::fwrite(cleared.data(), sizeof(uint64_t), stride, f) == stride;
+        if (isCompact()) ok = ok && std::fwrite(compact_memory.data(), sizeof(int16_t), compact_memory.size(), f) == compact_memory.size();
+        else ok = ok && std::fwrite(memory.data(), sizeof(float), memory.size(), f) == memory.size();
+        return ok;
+    }
+
+    // Reads the frames straight into a new buffer's memory, without a
+    // copy of the file in between. Null if it isn't a file save() wrote,
+    // or is cut short.
+    static DelayBuffer* load(FILE* f)
+    {
+        uint32_t header[2];
+        float sr;
+        uint8_t s;
+        uint8_t voices[LaneLayout::CHANNELS];
+        uint64_t position[4];
+        if (std::fread(header, sizeof(header), 1, f) != 1 || header[0] != FILE_MAGIC || header[1] != FILE_VERSION) return nullptr;
+        if (std::fread(&sr, sizeof(sr), 1, f) != 1 || std::fread(&s, sizeof(s), 1, f) != 1
+            || std::fread(voices, 1, LaneLayout::CHANNELS, f) != LaneLayout::CHANNELS
+            || std::fread(position, sizeof(position), 1, f) != 1) return nullptr;
+        if (!(sr >= 1000.f && sr <= 768000.f) || s >= STORAGE_LEN) return nullptr;
+
+        LaneLayout l;
+        for (int i = 0; i < LaneLayout::CHANNELS; i++) {
+            if (voices[i] > LaneLayout::MAX_VOICES) return nullptr;
+            l.set(i, voices[i]);
+        }
+        DelayBuffer* b = new DelayBuffer(sr, l, s);
+        bool ok = position[0] == b->size && position[1] == b->stride
+            && std::fread(b->cleared.data(), sizeof(uint64_t), b->stride, f) == b->stride;
+        if (b->isCompact()) ok = ok && std::fread(b->compact_memory.data(), sizeof(int16_t), b->compact_memory.size(), f) == b->compact_memory.size();
+        else ok = ok && std::fread(b->memory.data(), sizeof(float), b->memory.size(), f) == b->memory.size();
+        if (!ok) {
+            delete b;
+            return nullptr;
+        }
+        b->write = position[2] % b->size;
+        b->written = position[3];
+        for (uint64_t& c : b->cleared) c = std::min(c, b->written);
+        return b;
+    }
+
+    // O(1): the stale frames are overwritten as the buffer fills up again
+    void clear(int lane)
+    {
+        cleared[lane] = written;
+    }
+
+    // Writes one frame, stride samples per side. C is isCompact().
+    template <bool C>
+    inline void push(const float* in_l, const float* in_r)
+    {
+        size_t frame = write * 2 * stride;
+        size_t k = 0;
+        for (; k + 4 <= stride; k += 4) {
+            if (C) {
+                compress(simd::float_4::load(in_l + k), &compact_memory[frame + k]);
+                compress(simd::float_4::load(in_r + k), &compact_memory[frame + stride + k]);
+            }
+            else {
+                simd::float_4::load(in_l + k).store(&memory[frame + k]);
+                simd::float_4::load(in_r + k).store(&memory[frame + stride + k]);
+            }
+        }
+        // the last lanes, fewer than 4; in_l and in_r have room for 4
+        if (k < stride) {
+            int n = (int) (stride - k);
+            if (C) {
+                compress(simd::float_4::load(in_l + k), &compact_memory[frame + k], n);
+                compress(simd::float_4::load(in_r + k), &compact_memory[frame + stride + k], n);
+            }
+            else {
+                for (int j = 0; j < n; j++) {
+                    memory[frame + k + j] = in_l[k + j];
+                    memory[frame + stride + k + j] = in_r[k + j];
+                }
+            }
+        }
+        written++;
+        if (++write == size) write = 0;
+    }
+
+    // Reads back a lane of the frame pushed setback frames before the last one.
+    template <bool C>
+    inline void read(int lane, size_t setback, float& out_l, float& out_r) const
+    {
+        // how far back in the ring buffer we have to go to reach the appropriate delayed sample
+        setback = std::min(setback, size - 1);
+        size_t frame = back(setback + 1) * 2 * stride;
+
+        if (setback < written - cleared[lane]) {
+            if (C) {
+                out_l = compact_memory[frame + lane] * (1.f / COMPACT_SCALE);
+                out_r = compact_memory[frame + stride + lane] * (1.f / COMPACT_SCALE);
+            }
+            else {
+                out_l = memory[frame + lane];
+                out_r = memory[frame + stride + lane];
+            }
+        }
+        else {
+            out_l = out_r = 0.f;
+        }
+    }
+
+private:
+    // Rounds 4 samples to 16 bits, with triangular dither of +-1 LSB so that
+    // the rounding error is noise rather than distortion, and saturates.
+    // Only the first count are stored.
+    inline void compress(simd::float_4 x, int16_t* out, int count = 4)
+    {
+        simd::int32_4& d = dither_state;
+        d = d ^ (d << 13);
+        d = d ^ ((d >> 17) & simd::int32_4(0x7fff));
+        d = d ^ (d << 5);
+        // the difference of two uniform 16-bit values is triangular
+        simd::float_4 dither = simd::float_4(d & simd::int32_4(0xffff)) - simd::float_4((d >> 16) & simd::int32_4(0xffff));
+
+        simd::float_4 y = simd::clamp(x * COMPACT_SCALE + dither * (1.f / 65536.f), -32768.f, 32767.f);
+        // adding and taking away 1.5 * 2^23 rounds to the nearest integer
+        // in plain float arithmetic, and then truncating is exact
+        y = (y + 12582912.f) - 12582912.f;
+        simd::int32_4 n = simd::int32_4(y);
+        for (int j = 0; j < count; j++) out[j] = (int16_t) n[j];
+    }
+
+    inline float sample(size_t i) const
+    {
+        return isCompact() ? compact_memory[i] * (1.f / COMPACT_SCALE) : memory[i];
+    }
+
+    inline void setSample(size_t i, float x)
+    {
+        if (isCompact()) compact_memory[i] = (int16_t) std::min(std::max(std::round(x * COMPACT_SCALE), -32768.f), 32767.f);
+        else memory[i] = x;
+    }
+};
+
+
+// Terminal's three feedback channels, without any rack::Module state,
+// so that they can be driven (and profiled) outside of Rack.
+// The Terminal module only adds params, CV, buttons and ports on top.
+//
+// Every channel is polyphonic, with a delay line per voice, and all of them
+// live in the lanes of a single DelayBuffer. Memory is only committed for
+// the voices that are in use, at the current sample rate. The audio thread
+// states what it needs in swapBuffers(), some other thread allocates it in
+// prepareBuffers(), and the next swapBuffers() picks it up; neither ever
+// blocks the other. Each slot only ever goes from null to set on one side,
+// and back to null on the other.
+struct TerminalCore {
+    static const int CHANNELS = LaneLayout::CHANNELS;
+    static const int MAX_VOICES = LaneLayout::MAX_VOICES;
+    // per-frame arrays hold one float per lane, for up to this many lanes
+    static const int LANES = LaneLayout::MAX_LANES;
+
+    // used by the audio thread only; null until memory for it has arrived,
+    // in which case every channel reads back silence
+    DelayBuffer* buffer = nullptr;
+    // When the number of voices changes, the buffer from before sticks
+    // around until buffer holds a full delay memory of its own, and serves
+    // the reads that reach further back than that.
+    DelayBuffer* previous = nullptr;
+    // previous' lane for each of buffer's, -1 if there's none
+    int16_t previous_lane[LANES];
+    // allocated for the audio thread to pick up
+    std::atomic<DelayBuffer*> fresh{nullptr};
+    // given up by the audio thread, to be freed
+    std::atomic<DelayBuffer*> retired[2];
+    // set by the audio thread while it's waiting for memory
+    std::atomic<bool> needed{false};
+    // Saving and restoring delay memory, without ever stopping the audio
+    // thread. For a copy of buffer, some other thread hands over a blank
+    // one of the same shape in capture; the audio thread copies buffer
+    // into it over the next few swapBuffers() calls and hands it back in
+    // captured, with written set to 0 if there was nothing it could copy.
+    // restored is a buffer read back in, which prepareBuffers() starts the
+    // next buffer out from, and which swapBuffers() gives up buffer for.
+    std::atomic<DelayBuffer*> capture{nullptr};
+    std::atomic<DelayBuffer*> captured{nullptr};
+    std::atomic<DelayBuffer*> restored{nullptr};
+
+    // voices per channel, 0 if the channel is inactive
+    LaneLayout wanted;
+    // wanted, for prepareBuffers()
+    std::atomic<uint8_t> requested_voices[CHANNELS];
+    // the lanes the per-frame arrays are laid out in: buffer's, or wanted
+    // while there's no buffer
+    LaneLayout layout;
+
+    float sample_rate = 0.f;
+    // sample_rate, for prepareBuffers()
+    std::atomic<float> requested_rate{0.f};
+    // a DelayStorage: buffer's, which only changes once a buffer in the
+    // wanted one is adopted; and the wanted one, for prepareBuffers() too
+    uint8_t storage = STORAGE_FLOAT;
+    uint8_t wanted_storage = STORAGE_FLOAT;
+    std::atomic<uint8_t> requested_storage{STORAGE_FLOAT};
+
+    // While a channel is killed, its output fades out by fade_step per
+    // frame, and its lanes are cleared once it's silent.
+    float fade[CHANNELS];
+    float fade_step[CHANNELS] = {};
+    bool fading = false;
+
+    TerminalCore()
+    {
+        // the expanders' channels stay inactive until they're heard from
+        for (int i = 0; i < CHANNELS; i++) {
+            wanted.set(i, i < TERMINAL_CHANNELS ? 1 : 0);
+            requested_voices[i].store(0, std::memory_order_relaxed);
+        }
+        layout = wanted;
+        std::fill(fade, fade + CHANNELS, 1.f);
+        std::fill(taps, taps + CHANNELS, 1);
+        std::fill(cutoff, cutoff + CHANNELS, 1000.f);
+        spreadTaps(layout);
+        spreadInserts(layout);
+        std::fill(head, head + LANES, -1.f);
+        for (std::atomic<DelayBuffer*>& r : retired) r.store(nullptr, std::memory_order_relaxed);
+    }
+
+    ~TerminalCore()
+    {
+        delete buffer;
+        delete previous;
+        delete fresh.load();
+        for (std::atomic<DelayBuffer*>& r : retired) delete r.load();
+        delete capturing;
+        delete capture.load();
+        delete captured.load();
+        delete restored.load();
+    }
+
+    // Audio thread. Buffers for any other rate are retired by the next swapBuffers().
+    void setSampleRate(float sr)
+    {
+        sample_rate = sr;
+        spreadInserts(layout);
+        requested_rate.store(sr, std::memory_order_release);
+    }
+
+    // Audio thread. Changing the storage trades the buffer in for one
+    // converted to it, like a sample rate change does.
+    void setStorage(uint8_t s)
+    {
+        wanted_storage = s % STORAGE_LEN;
+        requested_storage.store(wanted_storage, std::memory_order_release);
+    }
+
+    // the longest delay time the storage in use holds, in seconds
+    float maxDelay() const
+    {
+        return storageSeconds(storage);
+    }
+
+    // Audio thread. Delay memory in use, in bytes, the buffer held on to
+    // after a voice change included.
+    size_t memoryBytes() const
+    {
+        return (buffer ? buffer->bytes() : 0) + (previous ? previous->bytes() : 0);
+    }
+
+    // Audio thread. How much of buffer holds signal, from 0 to 1, on
+    // average across lanes.
+    float fill() const
+    {
+        if (!buffer || !layout.lanes) return 0.f;
+        size_t filled = 0;
+        for (int lane = 0; lane < layout.lanes; lane++) filled += buffer->filled(lane);
+        return (float) filled / ((float) buffer->size * layout.lanes);
+    }
+
+    // Audio thread. 0 voices switches the channel off; it comes back with
+    // clear lanes. The change takes effect once swapBuffers() has a buffer
+    // for it, until then the lanes stay as they are in layout.
+    void setVoices(int i, int v)
+    {
+        v = std::min(v, (int) MAX_VOICES);
+        if (v != wanted.voices[i]) wanted.set(i, v);
+    }
+
+    // Fades the output out over KILL_FADE_TIME, instead of cutting it
+    // from one frame to the next, then clears the channel's lanes.
+    void kill(int i)
+    {
+        fade_step[i] = 1.f / std::max(1.f, KILL_FADE_TIME * sample_rate);
+        fading = true;
+    }
+
+    // Audio thread: gives up memory that isn't needed anymore, and picks up
+    // memory that has been prepared. Returns true if prepareBuffers() has
+    // something new to do.
+    bool swapBuffers()
+    {
+        bool work = false;
+        // a buffer for the wrong rate or storage gets traded in for a resampled
+        // one, and any buffer for one with restored memory
+        if (buffer && (wanted.lanes == 0 || buffer->sample_rate != sample_rate || buffer->storage != wanted_storage
+                || restored.load(std::memory_order_acquire)) && retire(buffer)) {
+            buffer = nullptr;
+            work = true;
+        }
+        // buffer has overwritten everything previous still had to offer
+        if (previous && (!buffer || buffer->written >= previous->size) && retire(previous)) {
+            previous = nullptr;
+            work = true;
+        }
+        // with nothing in memory to keep in place, the lanes just move
+        if (!buffer && layout != wanted) {
+            remapLanes(layout, wanted);
+            layout = wanted;
+        }
+
+        bool need = wanted.lanes > 0 && (!buffer || buffer->layout != wanted);
+        if (need) {
+            DelayBuffer* f = fresh.load(std::memory_order_acquire);
+            if (f && f->sample_rate == sample_rate && f->storage == wanted_storage && f->layout == wanted) {
+                // voices changed again before previous ran out: its history goes
+                if (previous && retire(previous)) {
+                    previous = nullptr;
+                    work = true;
+                }
+                if (!previous && fresh.compare_exchange_strong(f, nullptr)) {
+                    adopt(f);
+                    need = false;
+                }
+            }
+        }
+
+        for (int i = 0; i < CHANNELS; i++) {
+            if (requested_voices[i].load(std::memory_order_relaxed) != wanted.voices[i]) {
+                requested_voices[i].store(wanted.voices[i], std::memory_order_release);
+                work = true;
+            }
+        }
+        if (need != needed.load(std::memory_order_relaxed)) {
+            needed.store(need, std::memory_order_release);
+            work = true;
+        }
+        if (captureFrames()) work = true;
+        return work;
+    }
+
+    // Any thread but the audio thread: frees retired buffers and allocates
+    // the ones swapBuffers() asked for.
+    void prepareBuffers()
+    {
+        float sr = requested_rate.load(std::memory_order_acquire);
+        if (sr <= 0.f) return;
+        uint8_t s = requested_storage.load(std::memory_order_acquire);
+        LaneLayout want;
+        for (int i = 0; i < CHANNELS; i++) want.set(i, requested_voices[i].load(std::memory_order_acquire));
+
+        DelayBuffer* old[2];
+        for (int k = 0; k < 2; k++) old[k] = retired[k].exchange(nullptr, std::memory_order_acq_rel);
+
+        // prepared for a rate, storage or voices that have changed since,
+        // or from before memory was restored
+        DelayBuffer* f = fresh.load(std::memory_order_acquire);
+        if (f && (f->sample_rate != sr || f->storage != s || f->layout != want || restored.load(std::memory_order_acquire))
+                && fresh.compare_exchange_strong(f, nullptr)) {
+            delete f;
+            f = nullptr;
+        }
+
+        if (!f && want.lanes > 0 && needed.load(std::memory_order_acquire)) {
+            DelayBuffer* b = new DelayBuffer(sr, want, s);
+            DelayBuffer* r = restored.exchange(nullptr, std::memory_order_acq_rel);
+            if (r) {
+                b->resampleFrom(*r);
+                delete r;
+            }
+            // a sample rate or storage change retires the old buffer and asks
+            // for a new one at once; carry the loop over rather than going silent
+            for (int k = 0; !r && k < 2; k++) {
+                if (old[k] && (old[k]->sample_rate != sr || old[k]->storage != s)) {
+                    b->resampleFrom(*old[k]);
+                    break;
+                }
+            }
+            fresh.store(b, std::memory_order_release);
+        }
+        delete old[0];
+        delete old[1];
+    }
+
+    // Any thread but the audio thread: asks for a copy of the buffer, for
+    // captured to hand back. False if there is no memory to copy, or a
+    // copy is underway already.
+    bool requestCapture()
+    {
+        float sr = requested_rate.load(std::memory_order_acquire);
+        LaneLayout l;
+        for (int i = 0; i < CHANNELS; i++) l.set(i, requested_voices[i].load(std::memory_order_acquire));
+        if (sr <= 0.f || l.lanes == 0 || capture.load(std::memory_order_acquire)) return false;
+        capture.store(new DelayBuffer(sr, l, requested_storage.load(std::memory_order_acquire)), std::memory_order_release);
+        return true;
+    }
+
+    // Any thread but the audio thread: memory read back in, which takes
+    // the place of whatever is in the loop.
+    void restore(DelayBuffer* b)
+    {
+        delete restored.exchange(b, std::memory_order_acq_rel);
+    }
+
+private:
+    // the copy capture handed over, while the audio thread is making it:
+    // of capture_source, from when it had written capture_start frames,
+    // and capture_done of its frames copied so far, oldest first. Right
+    // after a voice change, the oldest come from capture_previous, that
+    // was previous then, with capture_lane for previous_lane.
+    DelayBuffer* capturing = nullptr;
+    DelayBuffer* capture_source = nullptr;
+    DelayBuffer* capture_previous = nullptr;
+    int16_t capture_lane[LANES];
+    uint64_t capture_start = 0;
+    uint64_t capture_last = 0;
+    size_t capture_done = 0;
+
+    // Copies the next part of buffer into capturing, and hands it back once
+    // it's complete. Every call copies at least twice as many frames as
+    // buffer has been pushed since the last, and CAPTURE_BYTES, so that the
+    // copy stays ahead of the write position, never comes across a frame
+    // written after it started, and never takes long on any one call.
+    // A copy asked for while memory is on its way for a new sample rate,
+    // storage or voice count waits for it to arrive. Returns true when it
+    // hands one back.
+    bool captureFrames()
+    {
+        if (!capturing) {
+            // until the last copy has been picked up, there's nowhere to hand a new one
+            if (captured.load(std::memory_order_acquire) || !capture.load(std::memory_order_acquire)) return false;
+            bool settled = buffer ? buffer->sample_rate == sample_rate && buffer->storage == wanted_storage && buffer->layout == wanted
+                : wanted.lanes == 0;
+            if (!settled || restored.load(std::memory_order_acquire)) return false;
+            capturing = capture.exchange(nullptr, std::memory_order_acq_rel);
+            capture_source = buffer;
+            // asked for in a shape that's gone by now
+            if (!buffer || buffer->sample_rate != capturing->sample_rate || buffer->storage != capturing->storage
+                    || buffer->layout != capturing->layout)
+                return handBackCapture(false);
+            capturing->write = buffer->write;
+            capture_start = capture_last = buffer->written;
+            capture_done = 0;
+            // reads that reach back further than buffer has been written
+            // go to previous, so the copy takes those frames from there, and
+            // counts them as written before buffer's
+            capture_previous = buffer->written < buffer->size ? previous : nullptr;
+            if (capture_previous) {
+                capturing->written = buffer->written + previous->written;
+                for (int lane = 0; lane < LANES; lane++) {
+                    capture_lane[lane] = previous_lane[lane];
+                    if (lane >= buffer->layout.lanes) continue;
+                    capturing->cleared[lane] = previous_lane[lane] >= 0 ? previous->cleared[previous_lane[lane]]
+                        : previous->written + buffer->cleared[lane];
+                }
+            }
+            else {
+                capturing->written = buffer->written;
+                std::copy(buffer->cleared.begin(), buffer->cleared.end(), capturing->cleared.begin());
+            }
+        }
+        // the oldest frames, that come from capture_previous
+        size_t from_previous = capture_previous ? buffer->size - capture_start : 0;
+        // buffer went, overwrote what was still to be copied, or gave up
+        // previous while that still had frames to copy
+        if (buffer != capture_source || buffer->written - capture_start > capture_done
+                || (capture_done < from_previous && previous != capture_previous))
+            return handBackCapture(false);
+
+        size_t frame_bytes = 2 * buffer->stride * (buffer->isCompact() ? sizeof(int16_t) : sizeof(float));
+        size_t n = std::max<size_t>(2 * (buffer->written - capture_last), CAPTURE_BYTES / frame_bytes);
+        n = std::min(n, buffer->size - capture_done);
+        capture_last = buffer->written;
+        for (; n > 0 && capture_done < from_previous; n--, capture_done++) {
+            size_t to = capturing->write + capture_done;
+            capturing->copyFrame(*capture_previous, capture_previous->back(from_previous - capture_done),
+                to < buffer->size ? to : to - buffer->size, capture_lane);
+        }
+        size_t first = capturing->write + capture_done;
+        capturing->copyFrames(*buffer, first < buffer->size ? first : first - buffer->size, n);
+        capture_done += n;
+        if (capture_done < buffer->size) return false;
+        return handBackCapture(true);
+    }
+
+    bool handBackCapture(bool complete)
+    {
+        if (!complete) capturing->written = 0;
+        captured.store(capturing, std::memory_order_release);
+        capturing = nullptr;
+        capture_source = nullptr;
+        capture_previous = nullptr;
+        return true;
+    }
+
+    // Hands a buffer over to prepareBuffers(), if there's a free slot.
+    bool retire(DelayBuffer* b)
+    {
+        for (std::atomic<DelayBuffer*>& r : retired) {
+            DelayBuffer* empty = nullptr;
+            if (r.compare_exchange_strong(empty, b, std::memory_order_acq_rel)) return true;
+        }
+        return false;
+    }
+
+    void adopt(DelayBuffer* f)
+    {
+        if (buffer) {
+            for (int lane = 0; lane < LANES; lane++) previous_lane[lane] = -1;
+            LaneLayout::match(buffer->layout, f->layout, [&](int a, int b) { previous_lane[b] = a; });
+            previous = buffer;
+        }
+        remapLanes(layout, f->layout);
+        layout = f->layout;
+        storage = f->storage;
+        buffer = f;
+        selectKernel();
+    }
+
+    // Moves the per-lane tap state along with the voices it belongs to.
+    void remapLanes(const LaneLayout& from, const LaneLayout& to)
+    {
+        float old_head[LANES], old_next_head[LANES], old_crossfade[LANES], old_allpass[2][HEADS][LANES], old_filter[2][LANES];
+        std::copy(filter_l, filter_l + LANES, old_filter[0]);
+        std::copy(filter_r, filter_r + LANES, old_filter[1]);
+        std::copy(head, head + LANES, old_head);
+        std::copy(next_head, next_head + LANES, old_next_head);
+        std::copy(crossfade, crossfade + LANES, old_crossfade);
+        for (int h = 0; h < HEADS; h++) {
+            std::copy(allpass_l[h], allpass_l[h] + LANES, old_allpass[0][h]);
+            std::copy(allpass_r[h], allpass_r[h] + LANES, old_allpass[1][h]);
+        }
+
+        std::fill(head, head + LANES, -1.f);
+        std::fill(next_head, next_head + LANES, 0.f);
+        std::fill(crossfade, crossfade + LANES, 0.f);
+        std::fill(filter_l, filter_l + LANES, 0.f);
+        std::fill(filter_r, filter_r + LANES, 0.f);
+        for (int h = 0; h < HEADS; h++) {
+            std::fill(allpass_l[h], allpass_l[h] + LANES, 0.f);
+            std::fill(allpass_r[h], allpass_r[h] + LANES, 0.f);
+        }
+
+        LaneLayout::match(from, to, [&](int a, int b) {
+            head[b] = old_head[a];
+            next_head[b] = old_next_head[a];
+            crossfade[b] = old_crossfade[a];
+            filter_l[b] = old_filter[0][a];
+            filter_r[b] = old_filter[1][a];
+            for (int h = 0; h < HEADS; h++) {
+                allpass_l[h][b] = old_allpass[0][h][a];
+                allpass_r[h][b] = old_allpass[1][h][a];
+            }
+        });
+        spreadTaps(to);
+        spreadInserts(to);
+    }
+
+    // A lane of the frame pushed setback frames before the last one,
+    // from previous if buffer doesn't go back that far yet. Both have
+    // the same storage, compact if C.
+    template <bool C>
+    inline void read(int lane, size_t setback, float& out_l, float& out_r) const
+    {
+        if (setback >= buffer->written && previous && previous_lane[lane] >= 0)
+            previous->read<C>(previous_lane[lane], setback - buffer->written, out_l, out_r);
+        else
+            buffer->read<C>(lane, setback, out_l, out_r);
+    }
+
+public:
+    /*==- DELAY TAPS -==*/
+    // The read taps sit between samples, so delay time modulation sweeps
+    // smoothly instead of stepping a whole sample at a time. Lanes are
+    // interpolated four at a time, left and right in a vector pass each.
+    enum Interpolation {
+        LINEAR,
+        HERMITE,
+        ALLPASS
+    };
+    uint8_t interpolation = LINEAR;
+    // In dual-head mode, jumps in delay time are crossfaded from the old
+    // tap position to the new one, instead of sweeping across everything
+    // in between.
+    bool dual_head = false;
+
+    // the tap position each lane reads from, in samples, or -1 until the
+    // lane's first frame, which sets it without a crossfade from 0
+    float head[LANES];
+    // while a lane crossfades to a new position: the new position,
+    // and how far the crossfade is, from 0 to 1
+    float next_head[LANES] = {};
+    float crossfade[LANES] = {};
+    bool crossfading = false;
+
+    // Each channel reads its delay line at up to MAX_TAPS points, summed
+    // before the gain: tap 0 at the delay time, and every other one at its
+    // own fraction of it (so delay CV moves them all alike), at its own level.
+    static const int MAX_TAPS = 4;
+    uint8_t taps[CHANNELS];
+    float tap_time[CHANNELS][MAX_TAPS] = {};
+    float tap_level[CHANNELS][MAX_TAPS] = {};
+    // the same, per lane; channels with fewer taps than max_taps have their
+    // extra ones at level 0
+    float lane_tap_time[MAX_TAPS][LANES] = {};
+    float lane_tap_level[MAX_TAPS][LANES] = {};
+    int max_taps = 1;
+
+    // last outputs of the allpass interpolators, for the current and next
+    // heads of every tap
+    static const int HEADS = 2 * MAX_TAPS;
+    float allpass_l[HEADS][LANES] = {};
+    float allpass_r[HEADS][LANES] = {};
+
+    // Audio thread. Tap 0 is always at the full delay time and level, the
+    // time and level of the others are fractions of 1.
+    void setTaps(int i, int n, const float time[MAX_TAPS], const float level[MAX_TAPS])
+    {
+        n = std::min(std::max(n, 1), (int) MAX_TAPS);
+        bool changed = n != taps[i];
+        for (int t = 1; t < MAX_TAPS; t++)
+            changed |= time[t] != tap_time[i][t] || level[t] != tap_level[i][t];
+        if (!changed) return;
+
+        taps[i] = n;
+        for (int t = 1; t < MAX_TAPS; t++) {
+            tap_time[i][t] = time[t];
+            tap_level[i][t] = level[t];
+        }
+        spreadTaps(layout);
+    }
+
+    void spreadTaps(const LaneLayout& l)
+    {
+        max_taps = 1;
+        for (int t = 0; t < MAX_TAPS; t++) {
+            std::fill(lane_tap_time[t], lane_tap_time[t] + LANES, t == 0 ? 1.f : 0.f);
+            std::fill(lane_tap_level[t], lane_tap_level[t] + LANES, t == 0 ? 1.f : 0.f);
+        }
+        for (int i = 0; i < CHANNELS; i++) {
+            if (!l.voices[i]) continue;
+            max_taps = std::max(max_taps, (int) taps[i]);
+            for (int t = 1; t < taps[i]; t++) {
+                std::fill(lane_tap_time[t] + l.offset[i], lane_tap_time[t] + l.offset[i] + l.voices[i], tap_time[i][t]);
+                std::fill(lane_tap_level[t] + l.offset[i], lane_tap_level[t] + l.offset[i] + l.voices[i], tap_level[i][t]);
+            }
+        }
+    }
+
+    // Reads the taps of lanes k to k + 3 at the given positions, in samples,
+    // scaled by ratio.
+    template <uint8_t I, bool C>
+    inline void tap(const float position[LANES], const float ratio[LANES], int h, int k, simd::float_4& out_l, simd::float_4& out_r)
+    {
+        // x[n] is the frame n - 1 frames further back than the whole part of
+        // the position, i.e. the tap sits between x[1] and x[2]
+        float x_l[4][4] = {}, x_r[4][4] = {};
+        float frac[4] = {};
+
+        const DelayBuffer* b = buffer;
+        int count = b ? std::min(layout.lanes - k, 4) : 0;
+        for (int j = 0; j < count; j++) {
+            int lane = k + j;
+
+            // the allpass is only well-behaved for fractions of 0.5 to 1.5
+            float p = position[lane] * ratio[lane];
+            if (I == ALLPASS) p = std::max(p - 0.5f, 0.f);
+            size_t n = (size_t) p;
+            frac[j] = p - n;
+
+            // only while the voices have just changed does any of this reach into previous
+            if (I == HERMITE) {
+                for (int m = 0; m < 4; m++) {
+                    size_t setback = n + m > 0 ? n + m - 1 : 0;
+                    if (previous) read<C>(lane, setback, x_l[m][j], x_r[m][j]);
+                    else b->read<C>(lane, setback, x_l[m][j], x_r[m][j]);
+                }
+            }
+            else if (previous) {
+                read<C>(lane, n, x_l[1][j], x_r[1][j]);
+                read<C>(lane, n + 1, x_l[2][j], x_r[2][j]);
+            }
+            else {
+                b->read<C>(lane, n, x_l[1][j], x_r[1][j]);
+                b->read<C>(lane, n + 1, x_l[2][j], x_r[2][j]);
+            }
+        }
+
+        simd::float_4 t = simd::float_4::load(frac);
+        simd::float_4 last_l = simd::float_4::load(allpass_l[h] + k);
+        simd::float_4 last_r = simd::float_4::load(allpass_r[h] + k);
+        out_l = interpolate<I>(x_l, t, last_l);
+        out_r = interpolate<I>(x_r, t, last_r);
+        if (I == ALLPASS) {
+            last_l.store(allpass_l[h] + k);
+            last_r.store(allpass_r[h] + k);
+        }
+    }
+
+    template <uint8_t I>
+    static inline simd::float_4 interpolate(const float x[4][4], simd::float_4 t, simd::float_4& last)
+    {
+        simd::float_4 x1 = simd::float_4::load(x[1]);
+        simd::float_4 x2 = simd::float_4::load(x[2]);
+        switch (I)
+        {
+            case LINEAR:
+                return x1 + (x2 - x1) * t;
+            case HERMITE: {
+                // 4-point, 3rd-order Hermite
+                simd::float_4 x0 = simd::float_4::load(x[0]);
+                simd::float_4 x3 = simd::float_4::load(x[3]);
+                simd::float_4 c1 = 0.5f * (x2 - x0);
+                simd::float_4 c2 = x0 - 2.5f * x1 + 2.f * x2 - 0.5f * x3;
+                simd::float_4 c3 = 0.5f * (x3 - x0) + 1.5f * (x1 - x2);
+                return ((c3 * t + c2) * t + c1) * t + x1;
+            }
+            default: {
+                // first-order allpass, for a delay of t + 0.5 between x1 and x2:
+                // flat magnitude response, but it smears fast modulation
+                simd::float_4 d = t + 0.5f;
+                simd::float_4 a = (1.f - d) / (1.f + d);
+                last = x2 + a * (x1 - last);
+                return last;
+            }
+        }
+    }
+    /*==- ---------- -==*/
+
+    /*==- INSERT -==*/
+    // Optional processing inside the loop, between the taps and the gain,
+    // per channel: a filter, then a soft clipper. Unlike a module patched
+    // between Departure and Arrival, it adds no cable delay to the loop.
+    enum InsertFilter {
+        FILTER_OFF,
+        LOWPASS,
+        HIGHPASS,
+        FILTERS_LEN
+    };
+    bool clip[CHANNELS] = {};
+    uint8_t filter[CHANNELS] = {};
+    // in Hz
+    float cutoff[CHANNELS];
+
+    // Per lane: how much of the soft clipped signal to use (0 or 1), the
+    // one-pole filter coefficient, and how much of its low-pass, high-pass
+    // and unfiltered outputs to mix.
+    float lane_clip[LANES] = {};
+    float lane_g[LANES] = {};
+    float lane_lowpass[LANES] = {};
+    float lane_highpass[LANES] = {};
+    float lane_dry[LANES] = {};
+    // whether any channel has an insert, otherwise it's skipped altogether
+    bool inserts = false;
+    // the filters' integrator states
+    float filter_l[LANES] = {};
+    float filter_r[LANES] = {};
+
+    // Audio thread.
+    void setInsert(int i, bool c, uint8_t f, float hz)
+    {
+        f %= FILTERS_LEN;
+        if (c == clip[i] && f == filter[i] && hz == cutoff[i]) return;
+        clip[i] = c;
+        filter[i] = f;
+        cutoff[i] = hz;
+        spreadInserts(layout);
+    }
+
+    void spreadInserts(const LaneLayout& l)
+    {
+        inserts = false;
+        std::fill(lane_clip, lane_clip + LANES, 0.f);
+        std::fill(lane_g, lane_g + LANES, 0.f);
+        std::fill(lane_lowpass, lane_lowpass + LANES, 0.f);
+        std::fill(lane_highpass, lane_highpass + LANES, 0.f);
+        std::fill(lane_dry, lane_dry + LANES, 1.f);
+        for (int i = 0; i < CHANNELS; i++) {
+            if (!l.voices[i] || (!clip[i] && filter[i] == FILTER_OFF)) continue;
+            inserts = true;
+
+            // zero-delay-feedback one-pole, prewarped so the cutoff is exact
+            float w = std::tan(float(M_PI) * std::min(cutoff[i], 0.49f * sample_rate) / std::max(sample_rate, 1.f));
+            std::fill(lane_g + l.offset[i], lane_g + l.offset[i] + l.voices[i], w / (1.f + w));
+            std::fill(lane_clip + l.offset[i], lane_clip + l.offset[i] + l.voices[i], clip[i] ? 1.f : 0.f);
+            std::fill(lane_lowpass + l.offset[i], lane_lowpass + l.offset[i] + l.voices[i], filter[i] == LOWPASS ? 1.f : 0.f);
+            std::fill(lane_highpass + l.offset[i], lane_highpass + l.offset[i] + l.voices[i], filter[i] == HIGHPASS ? 1.f : 0.f);
+            std::fill(lane_dry + l.offset[i], lane_dry + l.offset[i] + l.voices[i], filter[i] == FILTER_OFF ? 1.f : 0.f);
+        }
+    }
+
+    // Runs lanes k to k + 3 through their inserts.
+    inline simd::float_4 insert(simd::float_4 x, float* state, int k)
+    {
+        simd::float_4 s = simd::float_4::load(state + k);
+        simd::float_4 v = (x - s) * simd::float_4::load(lane_g + k);
+        simd::float_4 lowpass = v + s;
+        (lowpass + v).store(state + k);
+
+        simd::float_4 y = simd::float_4::load(lane_dry + k) * x
+            + simd::float_4::load(lane_lowpass + k) * lowpass
+            + simd::float_4::load(lane_highpass + k) * (x - lowpass);
+
+        simd::float_4 clipped = INSERT_CLIP_LEVEL * approx::softclip(y * (1.f / INSERT_CLIP_LEVEL));
+        return y + (clipped - y) * simd::float_4::load(lane_clip + k);
+    }
+    /*==- ------ -==*/
+
+    /*==- PROCESS KERNELS -==*/
+    // One kernel per interpolation x dual-head x compact storage combination,
+    // picked by selectKernel(), so the per-sample path doesn't switch on any.
+    //
+    // Processes one frame. Each Departure is the input mixed with its Arrival,
+    // read back at its taps (the first delay_time seconds back), run through
+    // its insert and multiplied by gain. All arrays hold
+    // one float per lane, as laid out in layout, left side first; lanes past
+    // layout.lanes are don't-cares.
+    template <uint8_t I, bool D, bool C>
+    void processKernel(const float input[2][LANES], const float arrival[2][LANES],
+                       const float gain[LANES], const float delay_time[LANES], float departure[2][LANES])
+    {
+        if (buffer) buffer->push<C>(arrival[0], arrival[1]);
+        int lanes = layout.lanes;
+
+        float step = 1.f / (DUAL_HEAD_FADE_TIME * sample_rate);
+        for (int lane = 0; lane < lanes; lane++) {
+            float position = sample_rate * delay_time[lane];
+            if (!D) {
+                head[lane] = position;
+            }
+            else if (crossfade[lane] > 0.f) {
+                // the new head follows the delay time until the crossfade is done
+                next_head[lane] = position;
+            }
+            else if (head[lane] >= 0.f && std::abs(position - head[lane]) > DUAL_HEAD_JUMP * sample_rate) {
+                next_head[lane] = position;
+                crossfade[lane] = step;
+                crossfading = true;
+            }
+            else {
+                head[lane] = position;
+            }
+        }
+
+        // the kill fades are per channel, spread out over their voices
+        float lane_fade[LANES];
+        if (fading) {
+            for (int i = 0; i < CHANNELS; i++)
+                std::fill(lane_fade + layout.offset[i], lane_fade + layout.offset[i] + layout.voices[i], fade[i]);
+        }
+
+        for (int k = 0; k < lanes; k += 4) {
+            simd::float_4 delayed_l = 0.f, delayed_r = 0.f;
+            for (int t = 0; t < max_taps; t++) {
+                simd::float_4 tap_l, tap_r;
+                tap<I, C>(head, lane_tap_time[t], 2 * t, k, tap_l, tap_r);
+
+                if (D && crossfading) {
+                    simd::float_4 next_l, next_r;
+                    tap<I, C>(next_head, lane_tap_time[t], 2 * t + 1, k, next_l, next_r);
+
+                    simd::float_4 x = simd::float_4::load(crossfade + k);
+                    tap_l += (next_l - tap_l) * x;
+                    tap_r += (next_r - tap_r) * x;
+                }
+
+                simd::float_4 level = simd::float_4::load(lane_tap_level[t] + k);
+                delayed_l += tap_l * level;
+                delayed_r += tap_r * level;
+            }
+
+            if (inserts) {
+                delayed_l = insert(delayed_l, filter_l, k);
+                delayed_r = insert(delayed_r, filter_r, k);
+            }
+
+            if (fading) {
+                simd::float_4 f = simd::float_4::load(lane_fade + k);
+                delayed_l *= f;
+                delayed_r *= f;
+            }
+
+            simd::float_4 g = simd::float_4::load(gain + k);
+            (simd::float_4::load(input[0] + k) + delayed_l * g).store(departure[0] + k);
+            (simd::float_4::load(input[1] + k) + delayed_r * g).store(departure[1] + k);
+        }
+
+        if (D && crossfading) {
+            crossfading = false;
+            for (int lane = 0; lane < lanes; lane++) {
+                if (crossfade[lane] <= 0.f) continue;
+                crossfade[lane] += step;
+                if (crossfade[lane] >= 1.f) {
+                    // the new head takes over
+                    head[lane] = next_head[lane];
+                    crossfade[lane] = 0.f;
+                    for (int t = 0; t < MAX_TAPS; t++) {
+                        allpass_l[2 * t][lane] = allpass_l[2 * t + 1][lane];
+                        allpass_r[2 * t][lane] = allpass_r[2 * t + 1][lane];
+                    }
+                }
+                else crossfading = true;
+            }
+        }
+
+        if (fading) {
+            fading = false;
+            for (int i = 0; i < CHANNELS; i++) {
+                if (fade_step[i] <= 0.f) continue;
+                fade[i] -= fade_step[i];
+                if (fade[i] <= 0.f) {
+                    for (int lane = layout.offset[i]; lane < layout.offset[i] + layout.voices[i]; lane++) {
+                        if (buffer) buffer->clear(lane);
+                        previous_lane[lane] = -1;
+                        filter_l[lane] = filter_r[lane] = 0.f;
+                    }
+                    fade[i] = 1.f;
+                    fade_step[i] = 0.f;
+                }
+                else fading = true;
+            }
+        }
+    }
+
+    typedef void (TerminalCore::*Kernel)(const float[2][LANES], const float[2][LANES], const float[LANES], const float[LANES], float[2][LANES]);
+    Kernel kernel = &TerminalCore::processKernel<LINEAR, false, false>;
+
+    // Also called when a buffer is adopted, as the storage in use is the buffer's.
+    void selectKernel()
+    {
+    #define KERNEL_PAIR(I, D) { &TerminalCore::processKernel<I, D, false>, &TerminalCore::processKernel<I, D, true> }
+    #define KERNEL_ROW(I) { KERNEL_PAIR(I, false), KERNEL_PAIR(I, true) }
+        static const Kernel kernels[3][2][2] = { KERNEL_ROW(LINEAR), KERNEL_ROW(HERMITE), KERNEL_ROW(ALLPASS) };
+    #undef KERNEL_ROW
+    #undef KERNEL_PAIR
+        kernel = kernels[interpolation % 3][dual_head][buffer && buffer->isCompact()];
+    }
+    /*==- --------------- -==*/
+
+    // Both swap kernels, so they're for the audio thread, between process()
+    // calls; see Terminal::processControls().
+    void setInterpolation(uint8_t i)
+    {
+        interpolation = i;
+        selectKernel();
+    }
+    void setDualHead(bool d)
+    {
+        dual_head = d;
+        crossfading = false;
+        std::fill(crossfade, crossfade + LANES, 0.f);
+        selectKernel();
+    }
+
+    inline void process(const float input[2][LANES], const float arrival[2][LANES],
+                        const float gain[LANES], const float delay_time[LANES], float departure[2][LANES])
+    {
+        (this->*kernel)(input, arrival, gain, delay_time, departure);
+    }
+};
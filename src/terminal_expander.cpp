@@ -0,0 +1,309 @@
+#include "plugin.hpp"
+#include "widgets.hpp"
+#include "control.hpp"
+#include "terminal.hpp"
+
+// Three more channels for Terminal, placed to its right (or to the right of
+// another expander). They have no memory of their own: their delay lines
+// run in Terminal's TerminalCore, fed with Terminal's input, and all this
+// module does is send over its controls and arrivals and play back the
+// departures it gets in return, see TerminalUpstream.
+struct TerminalExpander : Module {
+    enum ParamId {
+        GAIN1_PARAM,
+        GAIN2_PARAM,
+        GAIN3_PARAM,
+
+        DELAY1_PARAM,
+        DELAY2_PARAM,
+        DELAY3_PARAM,
+
+        KILL1_PARAM,
+        KILL2_PARAM,
+        KILL3_PARAM,
+        PARAMS_LEN
+    };
+
+    enum InputId {
+        ARRIVAL1_L_INPUT,
+        ARRIVAL1_R_INPUT,
+
+        ARRIVAL2_L_INPUT,
+        ARRIVAL2_R_INPUT,
+
+        ARRIVAL3_L_INPUT,
+        ARRIVAL3_R_INPUT,
+
+        GAIN1_MOD_INPUT,
+        GAIN2_MOD_INPUT,
+        GAIN3_MOD_INPUT,
+
+        DELAY1_MOD_INPUT,
+        DELAY2_MOD_INPUT,
+        DELAY3_MOD_INPUT,
+        INPUTS_LEN
+    };
+
+    enum OutputId {
+        DEPARTURE1_L_OUTPUT,
+        DEPARTURE1_R_OUTPUT,
+
+        DEPARTURE2_L_OUTPUT,
+        DEPARTURE2_R_OUTPUT,
+
+        DEPARTURE3_L_OUTPUT,
+        DEPARTURE3_R_OUTPUT,
+
+        OUTPUTS_LEN
+    };
+    enum LightsId {
+        LIGHTS_LEN
+    };
+
+    TerminalChannel channels[TERMINAL_CHANNELS];
+    // kill pressed since the last frame
+    bool kill[TERMINAL_CHANNELS] = {};
+
+    // from Terminal (via the expanders in between) and from the expanders to the right
+    TerminalDownstream downstream[2];
+    TerminalUpstream upstream[2];
+    // in the chain, counting from 0 next to Terminal, or MAX_EXPANDERS if
+    // this expander isn't part of one
+    int position = MAX_EXPANDERS;
+    float max_delay = DELAY_MEMORY_SIZE;
+
+    ControlClock control;
+
+    TerminalExpander()
+    {
+        config(PARAMS_LEN, INPUTS_LEN, OUTPUTS_LEN, LIGHTS_LEN);
+
+        for (uint8_t i = 0; i < TERMINAL_CHANNELS; i++) {
+            configParam(GAIN1_PARAM + i, 0.f, 1.f, 0.5f, string::f("Channel %d gain", i+1), "%", 0, 100);
+            configParam(DELAY1_PARAM + i, 0.f, (float)DELAY_MEMORY_SIZE, 1.5f, string::f("Channel %d delay time", i+1), " s");
+
+            configButton(KILL1_PARAM + i, string::f("Kill channel %d", i+1));
+
+            configInput(ARRIVAL1_L_INPUT + i*2, string::f("Channel %d stereo left feedback input", i+1));
+            configInput(ARRIVAL1_R_INPUT + i*2, string::f("Channel %d stereo right feedback input", i+1));
+            configInput(GAIN1_MOD_INPUT + i, string::f("Channel %d gain CV input", i+1));
+            configInput(DELAY1_MOD_INPUT + i, string::f("Channel %d delay CV input", i+1));
+
+            configOutput(DEPARTURE1_L_OUTPUT + i*2, string::f("Channel %d stereo left feedback output", i+1));
+            configOutput(DEPARTURE1_R_OUTPUT + i*2, string::f("Channel %d stereo right feedback output", i+1));
+        }
+
+        leftExpander.producerMessage = &downstream[0];
+        leftExpander.consumerMessage = &downstream[1];
+        rightExpander.producerMessage = &upstream[0];
+        rightExpander.consumerMessage = &upstream[1];
+    }
+
+    bool hasExpanderRight()
+    {
+        return rightExpander.module && rightExpander.module->model == modelTerminalExpander;
+    }
+
+    void processControls(const TerminalDownstream* message)
+    {
+        // Terminal's delay knobs reach further in long storage, and so do these
+        if (message && message->max_delay != max_delay) {
+            max_delay = message->max_delay;
+            for (int i = 0; i < TERMINAL_CHANNELS; i++)
+                paramQuantities[DELAY1_PARAM + i]->displayMultiplier = max_delay / DELAY_MEMORY_SIZE;
+        }
+
+        float range = max_delay / DELAY_MEMORY_SIZE;
+        for (int i = 0; i < TERMINAL_CHANNELS; i++) {
+            TerminalChannel& chan = channels[i];
+
+            // as in Terminal, where the input is
+            chan.voices = 0;
+            if (message && (outputs[DEPARTURE1_L_OUTPUT + i*2].isConnected() || outputs[DEPARTURE1_R_OUTPUT + i*2].isConnected())) {
+                chan.voices = std::max({ message->input_voices,
+                    inputs[ARRIVAL1_L_INPUT + i*2].getChannels(), inputs[ARRIVAL1_R_INPUT + i*2].getChannels() });
+            }
+
+            chan.setTargets(params[GAIN1_PARAM + i], inputs[GAIN1_MOD_INPUT + i],
+                params[DELAY1_PARAM + i], inputs[DELAY1_MOD_INPUT + i], range);
+
+            if (chan.kill_trigger.process(params[KILL1_PARAM + i].getValue()))
+                kill[i] = true;
+        }
+    }
+
+    void process(const ProcessArgs& args) override
+    {
+        // heard from Terminal, directly or through the expanders to the left
+        const TerminalDownstream* message = nullptr;
+        if (leftExpander.module && (leftExpander.module->model == modelTerminal || leftExpander.module->model == modelTerminalExpander)) {
+            message = (const TerminalDownstream*) leftExpander.consumerMessage;
+            if (message->position >= MAX_EXPANDERS) message = nullptr;
+        }
+        position = message ? message->position : MAX_EXPANDERS;
+
+        if (control.process()) processControls(message);
+
+        for (int i = 0; i < TERMINAL_CHANNELS; i++) {
+            int voices = message ? channels[i].voices : 0;
+            outputs[DEPARTURE1_L_OUTPUT + i*2].setChannels(std::max(voices, 1));
+            outputs[DEPARTURE1_R_OUTPUT + i*2].setChannels(std::max(voices, 1));
+            if (!voices) {
+                outputs[DEPARTURE1_L_OUTPUT + i*2].setVoltage(0.f);
+                outputs[DEPARTURE1_R_OUTPUT + i*2].setVoltage(0.f);
+            }
+            for (int v = 0; v < voices; v++) {
+                outputs[DEPARTURE1_L_OUTPUT + i*2].setVoltage(message->departure[position][i][0][v], v);
+                outputs[DEPARTURE1_R_OUTPUT + i*2].setVoltage(message->departure[position][i][1][v], v);
+            }
+        }
+
+        // pass Terminal's message on, with everything the expanders to the right need
+        if (hasExpanderRight()) {
+            TerminalDownstream* next = (TerminalDownstream*) rightExpander.module->leftExpander.producerMessage;
+            next->position = message ? position + 1 : MAX_EXPANDERS;
+            if (message) {
+                next->input_voices = message->input_voices;
+                next->max_delay = message->max_delay;
+                for (int k = position + 1; k < MAX_EXPANDERS; k++)
+                    std::memcpy(next->departure[k], message->departure[k], sizeof(next->departure[k]));
+            }
+            rightExpander.module->leftExpander.requestMessageFlip();
+        }
+
+        if (!message) return;
+
+        // and send ours back, with those of the expanders to the right
+        TerminalUpstream* back = (TerminalUpstream*) leftExpander.module->rightExpander.producerMessage;
+        back->expanders = position + 1;
+        if (hasExpanderRight()) {
+            const TerminalUpstream* from_right = (const TerminalUpstream*) rightExpander.consumerMessage;
+            back->expanders = std::max(back->expanders, std::min(from_right->expanders, (int) MAX_EXPANDERS));
+            for (int k = position + 1; k < back->expanders; k++)
+                std::memcpy(back->channels[k], from_right->channels[k], sizeof(back->channels[k]));
+        }
+
+        // The departures come back 2 * (position + 1) frames after the
+        // arrivals leave, so that much is taken off the delay time.
+        float latency = 2.f * (position + 1) * args.sampleTime;
+        for (int i = 0; i < TERMINAL_CHANNELS; i++) {
+            TerminalChannel& chan = channels[i];
+            TerminalExpanderChannel& out = back->channels[position][i];
+            out.voices = chan.voices;
+            out.kill = kill[i];
+            kill[i] = false;
+            if (!chan.voices) continue;
+
+            chan.processRamps(out.gain, out.delay_time, chan.voices);
+            for (int v = 0; v < chan.voices; v++) {
+                out.delay_time[v] = std::max(out.delay_time[v] - latency, 0.f);
+                out.arrival[0][v] = inputs[ARRIVAL1_L_INPUT + i*2].getPolyVoltage(v);
+                out.arrival[1][v] = inputs[ARRIVAL1_R_INPUT + i*2].getPolyVoltage(v);
+            }
+            out.taps = chan.taps;
+            std::copy(chan.tap_time, chan.tap_time + TerminalCore::MAX_TAPS, out.tap_time);
+            std::copy(chan.tap_level, chan.tap_level + TerminalCore::MAX_TAPS, out.tap_level);
+            out.clip = chan.clip;
+            out.filter = chan.filter;
+            out.cutoff_hz = chan.cutoffHz();
+        }
+        leftExpander.module->rightExpander.requestMessageFlip();
+    }
+
+    json_t *dataToJson() override
+    {
+        json_t *rootJ = json_object();
+
+        json_t *tapsJ = json_array();
+        json_t *insertsJ = json_array();
+        for (int i = 0; i < TERMINAL_CHANNELS; i++) {
+            json_array_append_new(tapsJ, channels[i].tapsToJson());
+            json_array_append_new(insertsJ, channels[i].insertToJson());
+        }
+        json_object_set_new(rootJ, "taps", tapsJ);
+        json_object_set_new(rootJ, "inserts", insertsJ);
+
+        return rootJ;
+    }
+
+    void dataFromJson(json_t *rootJ) override
+    {
+        json_t *tapsJ = json_object_get(rootJ, "taps");
+        json_t *insertsJ = json_object_get(rootJ, "inserts");
+        for (int i = 0; i < TERMINAL_CHANNELS; i++) {
+            channels[i].tapsFromJson(json_array_get(tapsJ, i));
+            channels[i].insertFromJson(json_array_get(insertsJ, i));
+        }
+    }
+
+    void onReset() override
+    {
+        for (int i = 0; i < TERMINAL_CHANNELS; i++) {
+            channels[i].resetTaps();
+            channels[i].resetInsert();
+        }
+    }
+};
+
+struct TerminalExpanderWidget : ModuleWidget {
+    TerminalExpanderWidget(TerminalExpander* module) {
+        setModule(module);
+        setPanel(createPanel(asset::plugin(pluginInstance, "res/panels/terminal_expander.svg")));
+
+        addChild(createWidget<ScrewSilver>(Vec(RACK_GRID_WIDTH, 0)));
+        addChild(createWidget<ScrewSilver>(Vec(box.size.x - 2 * RACK_GRID_WIDTH, 0)));
+        addChild(createWidget<ScrewSilver>(Vec(RACK_GRID_WIDTH, RACK_GRID_HEIGHT - RACK_GRID_WIDTH)));
+        addChild(createWidget<ScrewSilver>(Vec(box.size.x - 2 * RACK_GRID_WIDTH, RACK_GRID_HEIGHT - RACK_GRID_WIDTH)));
+
+        // Terminal's panel, without the input section
+        // knobs
+        addParam(createParamCentered<MF_MediumKnob>(mm2px(Vec(61.89, 18.39)), module, TerminalExpander::GAIN1_PARAM));
+        addParam(createParamCentered<MF_MediumKnob>(mm2px(Vec(61.89, 35.53)), module, TerminalExpander::DELAY1_PARAM));
+
+        addParam(createParamCentered<MF_MediumKnob>(mm2px(Vec(61.89, 55.37)), module, TerminalExpander::GAIN2_PARAM));
+        addParam(createParamCentered<MF_MediumKnob>(mm2px(Vec(61.89, 72.5)), module, TerminalExpander::DELAY2_PARAM));
+
+        addParam(createParamCentered<MF_MediumKnob>(mm2px(Vec(61.89, 92.34)), module, TerminalExpander::GAIN3_PARAM));
+        addParam(createParamCentered<MF_MediumKnob>(mm2px(Vec(61.89, 109.47)), module, TerminalExpander::DELAY3_PARAM));
+
+        // buttons
+        addParam(createParamCentered<MF_MiniButton>(mm2px(Vec(24.18, 43.65)), module, TerminalExpander::KILL1_PARAM));
+        addParam(createParamCentered<MF_MiniButton>(mm2px(Vec(24.18, 80.54)), module, TerminalExpander::KILL2_PARAM));
+        addParam(createParamCentered<MF_MiniButton>(mm2px(Vec(24.18, 117.52)), module, TerminalExpander::KILL3_PARAM));
+
+        // inputs
+        addInput(createInputCentered<PJ301MPort>(mm2px(Vec(37.89, 23.31)), module, TerminalExpander::ARRIVAL1_L_INPUT));
+        addInput(createInputCentered<PJ301MPort>(mm2px(Vec(37.89, 33.67)), module, TerminalExpander::ARRIVAL1_R_INPUT));
+        addInput(createInputCentered<PJ301MPort>(mm2px(Vec(37.89, 60.29)), module, TerminalExpander::ARRIVAL2_L_INPUT));
+        addInput(createInputCentered<PJ301MPort>(mm2px(Vec(37.89, 70.65)), module, TerminalExpander::ARRIVAL2_R_INPUT));
+        addInput(createInputCentered<PJ301MPort>(mm2px(Vec(37.89, 97.26)), module, TerminalExpander::ARRIVAL3_L_INPUT));
+        addInput(createInputCentered<PJ301MPort>(mm2px(Vec(37.89, 107.62)), module, TerminalExpander::ARRIVAL3_R_INPUT));
+
+        addInput(createInputCentered<PJ301MPort>(mm2px(Vec(73.97, 18.46)), module, TerminalExpander::GAIN1_MOD_INPUT));
+        addInput(createInputCentered<PJ301MPort>(mm2px(Vec(73.97, 35.6)), module, TerminalExpander::DELAY1_MOD_INPUT));
+        addInput(createInputCentered<PJ301MPort>(mm2px(Vec(73.97, 55.44)), module, TerminalExpander::GAIN2_MOD_INPUT));
+        addInput(createInputCentered<PJ301MPort>(mm2px(Vec(73.97, 72.58)), module, TerminalExpander::DELAY2_MOD_INPUT));
+        addInput(createInputCentered<PJ301MPort>(mm2px(Vec(73.97, 92.41)), module, TerminalExpander::GAIN3_MOD_INPUT));
+        addInput(createInputCentered<PJ301MPort>(mm2px(Vec(73.97, 109.55)), module, TerminalExpander::DELAY3_MOD_INPUT));
+
+        // outputs
+        addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(13.29, 23.31)), module, TerminalExpander::DEPARTURE1_L_OUTPUT));
+        addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(13.29, 33.67)), module, TerminalExpander::DEPARTURE1_R_OUTPUT));
+        addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(13.29, 60.29)), module, TerminalExpander::DEPARTURE2_L_OUTPUT));
+        addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(13.29, 70.65)), module, TerminalExpander::DEPARTURE2_R_OUTPUT));
+        addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(13.29, 97.26)), module, TerminalExpander::DEPARTURE3_L_OUTPUT));
+        addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(13.29, 107.62)), module, TerminalExpander::DEPARTURE3_R_OUTPUT));
+    }
+
+    void appendContextMenu(Menu* menu) override
+    {
+        TerminalExpander* module = getModule<TerminalExpander>();
+
+        // interpolation and delay memory are Terminal's, for all channels
+        menu->addChild(new MenuSeparator);
+        for (int i = 0; i < TERMINAL_CHANNELS; i++) module->channels[i].appendTapsMenu(menu, i+1);
+        for (int i = 0; i < TERMINAL_CHANNELS; i++) module->channels[i].appendInsertMenu(menu, i+1);
+    }
+};
+
+Model* modelTerminalExpander = createModel<TerminalExpander, TerminalExpanderWidget>("terminal-expander");
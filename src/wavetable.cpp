@@ -0,0 +1,48 @@
+#include <cmath>
+#include <cstring>
+#include "wavetable.hpp"
+
+
+const Wavetable& Wavetable::get()
+{
+    // function-local statics are initialized exactly once, even if
+    // several modules are created from different threads at the same time
+    static const Wavetable wavetable;
+    return wavetable;
+}
+
+Wavetable::Wavetable()
+{
+    // one cycle of sin, so that harmonic h at point n is sines[(h*n) % SIZE]
+    // and building the tables is only multiply-adds
+    static double sines[SIZE];
+    for (int n = 0; n < SIZE; n++) sines[n] = std::sin(2.0 * M_PI * n / SIZE);
+
+    // Fourier series of the waveshapes Kanon uses for the polyBLEP engine:
+    // sine     sin(2 pi p)
+    // triangle -1 at p = 0, +1 at p = 1/2: -8/pi^2 * sum_odd cos(2 pi h p) / h^2
+    // square   -1 below p = 1/2, +1 above: -4/pi * sum_odd sin(2 pi h p) / h
+    // saw      2p - 1:                     -2/pi * sum sin(2 pi h p) / h
+    for (int l = 0; l < LEVELS; l++) {
+        int harmonics = (SIZE / 2) >> l;
+
+        for (int n = 0; n < SIZE; n++) {
+            double triangle = 0.0, square = 0.0, saw = 0.0;
+            for (int h = 1; h <= harmonics; h++) {
+                double s = sines[(h * n) % SIZE];
+                double c = sines[(h * n + SIZE / 4) % SIZE];
+                if (h % 2 == 1) {
+                    triangle += c / (h * h);
+                    square += s / h;
+                }
+                saw += s / h;
+            }
+            tables[0][l][n] = (float) sines[n];
+            tables[1][l][n] = (float) (-8.0 / (M_PI * M_PI) * triangle);
+            tables[2][l][n] = (float) (-4.0 / M_PI * square);
+            tables[3][l][n] = (float) (-2.0 / M_PI * saw);
+        }
+
+        for (int w = 0; w < SHAPES; w++) tables[w][l][SIZE] = tables[w][l][0];
+    }
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <simd/Vector.hpp>
+#include <simd/functions.hpp>
+
+// Band-limited, mipmapped single-cycle tables for Kanon's waveshapes.
+//
+// Each waveshape has one table per octave, where table l only holds the
+// harmonics that stay below Nyquist for every pitch it is used for. The
+// whole set (~160 KB) is built once, the first time get() is called, and
+// is then shared read-only by every Kanon instance.
+//
+// Tables are indexed with a 32-bit phase accumulator, where 2^32 is one
+// full cycle: wraparound is free and the phase never drifts, however long
+// the oscillator runs.
+struct Wavetable {
+    static const int SIZE_BITS = 10;
+    static const int SIZE = 1 << SIZE_BITS;
+    // table l holds (SIZE/2 >> l) harmonics
+    static const int LEVELS = SIZE_BITS;
+    static const int SHAPES = 4;
+
+    // +1 guard point, so interpolation never has to wrap
+    float tables[SHAPES][LEVELS][SIZE + 1];
+
+    // Built on first call. Call it off the audio thread.
+    static const Wavetable& get();
+
+    // Reads 4 voices of waveshape w at the given phases, picking for each
+    // voice the table whose harmonics fit below Nyquist at increment dt.
+    // Voices whose bit isn't set in mask are skipped and read as 0.
+    rack::simd::float_4 lookup(uint8_t w, rack::simd::int32_4 phase, rack::simd::float_4 dt, uint8_t mask = 0xf) const
+    {
+        rack::simd::float_4 out = 0.f;
+        for (int i = 0; i < 4; i++) {
+            if (!(mask & (1 << i))) continue;
+            const float* table = tables[w][level(dt[i])];
+            uint32_t p = (uint32_t) phase[i];
+            uint32_t index = p >> (32 - SIZE_BITS);
+            float frac = (float) (p & ((1u << (32 - SIZE_BITS)) - 1)) * (1.f / (1u << (32 - SIZE_BITS)));
+            out[i] = table[index] + (table[index + 1] - table[index]) * frac;
+        }
+        return out;
+    }
+
+private:
+    Wavetable();
+
+    // Smallest l for which (SIZE/2 >> l) * dt <= 1/2, read from the float
+    // exponent of SIZE * dt instead of a log2() call.
+    static inline int level(float dt)
+    {
+        float x = dt * SIZE;
+        int32_t bits;
+        std::memcpy(&bits, &x, sizeof(bits));
+        int l = ((bits >> 23) & 0xff) - 127 + 1;
+        return l < 0 ? 0 : l >= LEVELS ? LEVELS - 1 : l;
+    }
+};
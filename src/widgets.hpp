@@ -1,3 +1,4 @@
+#pragma once
 #include <rack.hpp>
 
 struct MF_JumboKnob : RoundKnob {
@@ -30,4 +31,44 @@ struct MF_Port : SvgPort {
     MF_Port() {
         setSvg(Svg::load(asset::plugin(pluginInstance, "res/components/port.svg")));
     }
+};
+
+// Context menu slider over a plain float the module keeps, for settings that
+// don't merit a knob on the panel. Values go from 0 to 1, and are shown as
+// percent, or like a ParamQuantity with a display base, as
+// multiplier * base^value in unit.
+struct MF_MenuSlider : ui::Slider {
+    struct MenuQuantity : Quantity {
+        float* value;
+        float default_value;
+        std::string label;
+        std::string unit = "%";
+        float base = 0.f;
+        float multiplier = 100.f;
+
+        void setValue(float v) override { *value = math::clamp(v, 0.f, 1.f); }
+        float getValue() override { return *value; }
+        float getDefaultValue() override { return default_value; }
+        float getDisplayValue() override { return base > 0.f ? std::pow(base, *value) * multiplier : *value * multiplier; }
+        void setDisplayValue(float v) override { setValue(base > 0.f ? std::log(v / multiplier) / std::log(base) : v / multiplier); }
+        int getDisplayPrecision() override { return 3; }
+        std::string getLabel() override { return label; }
+        std::string getUnit() override { return unit; }
+    };
+
+    MF_MenuSlider(std::string label, float* value, float default_value, std::string unit = "%", float base = 0.f, float multiplier = 100.f) {
+        MenuQuantity* q = new MenuQuantity;
+        q->value = value;
+        q->default_value = default_value;
+        q->label = label;
+        q->unit = unit;
+        q->base = base;
+        q->multiplier = multiplier;
+        quantity = q;
+        box.size.x = 200.f;
+    }
+
+    ~MF_MenuSlider() {
+        delete quantity;
+    }
 };
\ No newline at end of file
@@ -0,0 +1,134 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Background work for whatever a module must not do on the audio thread,
+// like allocating and freeing memory. Every module has a Worker with a job
+// of its own, and one thread runs the jobs of all of them, whenever they're
+// woken; it's started along with the first Worker, and stopped once the
+// last one goes. It sleeps until then, without ever waking up on its own.
+struct Worker {
+    // The thread, and the Workers it runs the jobs of.
+    struct Thread {
+        std::mutex mutex;
+        std::condition_variable wakeup;
+        // notified whenever a job has run, for a Worker waiting to go away
+        std::condition_variable ran;
+        // guarded by mutex
+        std::vector<Worker*> workers;
+        Worker* running_job = nullptr;
+        bool running = true;
+        // set whenever some Worker's pending is
+        std::atomic<bool> pending{false};
+        std::thread thread;
+
+        Thread()
+        {
+            thread = std::thread([this]() { run(); });
+        }
+
+        ~Thread()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                running = false;
+            }
+            wakeup.notify_one();
+            thread.join();
+        }
+
+        // The shared one, started if there isn't one.
+        static std::shared_ptr<Thread> get()
+        {
+            static std::mutex m;
+            static std::weak_ptr<Thread> shared;
+            std::lock_guard<std::mutex> lock(m);
+            std::shared_ptr<Thread> t = shared.lock();
+            if (!t) {
+                t = std::make_shared<Thread>();
+                shared = t;
+            }
+            return t;
+        }
+
+        // Never blocks. A thread that's just found nothing to do holds the
+        // mutex until it waits, and a notification before then would be
+        // lost, so there's none: false means it has to be tried again.
+        bool signal()
+        {
+            if (!mutex.try_lock()) return false;
+            mutex.unlock();
+            wakeup.notify_one();
+            return true;
+        }
+
+        void run()
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (running) {
+                if (!pending.exchange(false)) {
+                    wakeup.wait(lock);
+                    continue;
+                }
+                for (size_t i = 0; i < workers.size(); i++) {
+                    Worker* w = workers[i];
+                    if (!w->pending.exchange(false)) continue;
+                    running_job = w;
+                    lock.unlock();
+                    w->job();
+                    lock.lock();
+                    running_job = nullptr;
+                    ran.notify_all();
+                }
+            }
+        }
+    };
+
+    void start(std::function<void()> j)
+    {
+        job = j;
+        thread = Thread::get();
+        std::lock_guard<std::mutex> lock(thread->mutex);
+        thread->workers.push_back(this);
+    }
+
+    // Any thread, the audio thread included: never blocks. Runs the job
+    // soon, at the latest right after the next retry().
+    void wake()
+    {
+        pending.store(true);
+        thread->pending.store(true);
+        unsent.store(!thread->signal());
+    }
+
+    // Audio thread, at control rate: delivers a wake-up that wake() had to
+    // leave for later, if any.
+    inline void retry()
+    {
+        if (unsent.load(std::memory_order_relaxed) && thread->signal()) unsent.store(false);
+    }
+
+    ~Worker()
+    {
+        if (!thread) return;
+        std::unique_lock<std::mutex> lock(thread->mutex);
+        std::vector<Worker*>& workers = thread->workers;
+        workers.erase(std::find(workers.begin(), workers.end(), this));
+        // the thread may skip a job as the ones after this move along, so
+        // it has to go over them again
+        thread->pending.store(true);
+        thread->ran.wait(lock, [this]() { return thread->running_job != this; });
+    }
+
+private:
+    std::function<void()> job;
+    std::shared_ptr<Thread> thread;
+    std::atomic<bool> pending{false};
+    std::atomic<bool> unsent{false};
+};